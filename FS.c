@@ -6,16 +6,18 @@
 #include "FreeRTOS.h"
 #include "SPI.h"
 #include "FS.h"
+#include "FSFreeMap.h"
 #include "diskio.h"
 #include "ff.h"
 #include "TTerm.h"
 #include "diskioConfig.h"
+#include "diskPin.h"
 #include "System.h"
 #include "AccelLogger.h"
 
 //#define DEBUG
 
-typedef enum {SD_NOT_PRESENT, SD_LOW_POWER, SD_READY, SD_ERROR} FSState_t;
+typedef enum {SD_NOT_PRESENT = FS_POWER_NOT_PRESENT, SD_LOW_POWER = FS_POWER_LOW_POWER, SD_READY = FS_POWER_READY, SD_ERROR = FS_POWER_ERROR} FSState_t;
 typedef enum {FSCMD_TIMEOUT = 0, FSCMD_SD_ACCESSED, FSCMD_GO_LP, FSCMD_IOEVT} FSCMD_t;
 
 static uint8_t FS_testCommand(TERMINAL_HANDLE * handle, uint8_t argCount, char ** args);
@@ -25,16 +27,48 @@ SemaphoreHandle_t sdCMD; //TODO init
 static volatile FSState_t currState = SD_NOT_PRESENT;
 static void FS_task(void * params);
 static TaskHandle_t FS_taskHandle;
+
+//power state accounting
+static FS_powerStats_t powerStats;
+static TickType_t stateEnteredAt;
+
+//deferred io
+typedef struct{
+    FS_deferredJob_t job;
+    void * context;
+    TickType_t deadline;
+} FS_deferredEntry_t;
+
+static QueueHandle_t deferQueue;
+static void FS_deferTask(void * params);
+static TaskHandle_t FS_deferTaskHandle;
+
+static void FS_setState(FSState_t newState){
+    //FS_getPowerStats reads all of this in a critical section
+    taskENTER_CRITICAL();
+    TickType_t now = xTaskGetTickCount();
+    powerStats.timeInState[currState] += now - stateEnteredAt;
+    stateEnteredAt = now;
+    
+    if(currState == SD_LOW_POWER && newState == SD_READY) powerStats.wakes++;
+    
+    currState = newState;
+    taskEXIT_CRITICAL();
     
+    //let the deferred jobs run while the card is awake anyway, or hold them while there is none
+    xTaskNotifyGive(FS_deferTaskHandle);
+}
 
 static void goLowPower(SPIHandle_t * handle){
+    //let running transfers finish and mark the card uninitialized before the bus goes away
+    disk_uninitialize(0);
+    
     //power down spi module
     handle->CON->ON = 0;
     TRISBSET = _LATB_LATB10_MASK | _LATB_LATB11_MASK | _LATB_LATB15_MASK;
     
     //power down sd card and drop vdd to 2.3V
     LATBCLR = _LATB_LATB5_MASK;
-    disk_uninitialize(0);
                         //TERM_printDebug(TERM_handle, "went low power\r\n");
 }
 
@@ -72,6 +106,17 @@ static uint32_t initSD(SPIHandle_t * handle){
     return 0;
 }
 
+/* Renews the power timeout if the card is awake. Unlike FS_clearPowerTimeout it never waits for the card to be powered
+ * up, as the driver calls it with the bus held and FS_task needs the bus to do that. Returns 0 if the card is asleep */
+uint32_t FS_renewPowerTimeout(){
+    if(xTaskGetCurrentTaskHandle() == FS_taskHandle) return 1;
+    if(currState != SD_READY) return 0;
+    
+    FSCMD_t cmd = FSCMD_SD_ACCESSED;
+    xQueueSend(sdQueue, &cmd, 0);
+    return 1;
+}
+
 void FS_sdCardIOEvtHandler(){
     //send cmd to fs task queue
     FSCMD_t cmd = FSCMD_IOEVT;
@@ -122,6 +167,7 @@ uint32_t FS_clearPowerTimeout(){
 void FS_init(SPIHandle_t * spiHandle){
     sdQueue = xQueueCreate(2, sizeof(FSCMD_t));
     sdCMD = xSemaphoreCreateBinary();
+    deferQueue = xQueueCreate(FS_DEFER_QUEUE_LENGTH, sizeof(FS_deferredEntry_t));
     
     //sd card cs
     LATBSET = _LATB_LATB10_MASK;
@@ -130,6 +176,8 @@ void FS_init(SPIHandle_t * spiHandle){
     SPI_setCLKFreq(spiHandle, 400000);
     
     
+    //the defer task has to exist before FS_task can change the state
+    xTaskCreate(FS_deferTask, "fs defer", FS_DEFER_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1, &FS_deferTaskHandle);
     xTaskCreate(FS_task, "fs Task", configMINIMAL_STACK_SIZE + 200, spiHandle, tskIDLE_PRIORITY + 4, &FS_taskHandle);
     
     FSCMD_t cmd = FSCMD_IOEVT;
@@ -145,6 +193,9 @@ static void FS_task(void * params){
     
     FSCMD_t currCMD;
     
+    //the free cluster map gets built once the card is woken up after mounting, not right away
+    uint32_t mapPending = 0;
+    
     while(1){
         //wait until we get notified of an event
         //Timeout depends on the state the machine is in, if the card is powered up we need to have a timeout
@@ -170,7 +221,8 @@ static void FS_task(void * params){
                 if(currState == SD_NOT_PRESENT){
                     //no, mount it (but don't initialize it yet!)
                     f_mount(fso, "", 0);
-                    currState = SD_LOW_POWER;
+                    FS_setState(SD_LOW_POWER);
+                    mapPending = 1;
                 //TERM_printDebug(TERM_handle, "card was mounted\r\n");
                 }
                 
@@ -183,8 +235,11 @@ static void FS_task(void * params){
                 //does the fs know about it?
                 if(currState != SD_NOT_PRESENT){
                     //no, unmount it
+                    FSFM_stop();
+                    mapPending = 0;
+                    PIN_dropDrive(0);
                     f_mount(NULL, "", 0);
-                    currState = SD_NOT_PRESENT;
+                    FS_setState(SD_NOT_PRESENT);
                     goLowPower(handle);
                 //TERM_printDebug(TERM_handle, "card was unmounted\r\n");
                 }
@@ -203,12 +258,18 @@ static void FS_task(void * params){
                 
                 if(initSD(handle)){
                     //init succeeded
-                    currState = SD_READY;
+                    FS_setState(SD_READY);
                         //TERM_printDebug(TERM_handle, "succcccccess\r\n");
+                    
+                    //build the free cluster map in the background while the card is awake anyway
+                    if(mapPending){
+                        FSFM_start(fso);
+                        mapPending = 0;
+                    }
                 }else{
                     //init failed :( power down the card again and set error state
                     goLowPower(handle);
-                    currState = SD_ERROR;   //error state will remain until write timeout occurs
+                    FS_setState(SD_ERROR);   //error state will remain until write timeout occurs
                     TERM_printDebug(TERM_handle, "sd init failure :( locking out until timeout\r\n");
                 }
             }
@@ -217,9 +278,9 @@ static void FS_task(void * params){
             if(currState == SD_READY){
                 goLowPower(handle);
                         //TERM_printDebug(TERM_handle, "powering down card\r\n");
-                currState = SD_LOW_POWER; 
+                FS_setState(SD_LOW_POWER); 
             }else if(currState == SD_ERROR){
-                currState = SD_LOW_POWER; 
+                FS_setState(SD_LOW_POWER); 
                 TERM_printDebug(TERM_handle, "sd error time out\r\n");
             }
         }else{
@@ -233,6 +294,100 @@ static void FS_task(void * params){
     }
 }
 
+/*
+ * Deferred io
+ *
+ * Background work like telemetry flushes or log rotation doesn't need to run right away. Every isolated access from a task
+ * wakes the card, runs the init and then keeps it powered for FS_SD_ACCESS_TIMEOUT, so such jobs are collected here while 
+ * the card sleeps. They run as soon as anything else wakes the card, or once the earliest of their deadlines passed. While
+ * no card is inserted or it failed to initialize they are held until their deadline and then dropped, they must not run
+ * against a card that isn't there or a different one inserted much later.
+ */
+
+//queues job to run with the card awake within maxDeferral ticks. Returns 0 if the queue is full
+uint32_t FS_defer(FS_deferredJob_t job, void * context, TickType_t maxDeferral){
+    if(job == NULL) return 0;
+    
+    FS_deferredEntry_t entry = {.job = job, .context = context, .deadline = xTaskGetTickCount() + maxDeferral};
+    if(xQueueSend(deferQueue, &entry, 0) != pdTRUE) return 0;
+    
+    xTaskNotifyGive(FS_deferTaskHandle);
+    return 1;
+}
+
+static void FS_deferTask(void * params){
+    FS_deferredEntry_t pending[FS_DEFER_QUEUE_LENGTH];
+    uint32_t pendingCount = 0;
+    
+    while(1){
+        //take over the new jobs, anything that doesn't fit stays queued until the pending ones ran
+        while(pendingCount < FS_DEFER_QUEUE_LENGTH && xQueueReceive(deferQueue, &pending[pendingCount], 0)) pendingCount++;
+        
+        FSState_t state = currState;
+        TickType_t now = xTaskGetTickCount();
+        
+        //nothing can run without a working card, drop whatever is past its deadline
+        if(state == SD_NOT_PRESENT || state == SD_ERROR){
+            uint32_t kept = 0;
+            for(uint32_t i = 0; i < pendingCount; i++){
+                if((int32_t) (pending[i].deadline - now) > 0) pending[kept++] = pending[i];
+            }
+            
+            if(kept != pendingCount){
+                taskENTER_CRITICAL();
+                powerStats.deferredJobsDropped += pendingCount - kept;
+                taskEXIT_CRITICAL();
+                pendingCount = kept;
+                continue;   //there might be room for more of the queued ones now
+            }
+        }
+        
+        TickType_t waitTime = portMAX_DELAY;
+        for(uint32_t i = 0; i < pendingCount; i++){
+            TickType_t left = ((int32_t) (pending[i].deadline - now) > 0) ? pending[i].deadline - now : 0;
+            if(left < waitTime) waitTime = left;
+        }
+        
+        //run them while the card is awake anyway. If a deadline passed or we are out of space the card gets woken up first,
+        //should that fail they stay pending and get dropped with the card in SD_ERROR
+        uint32_t deadlineWake = (state == SD_LOW_POWER);
+        if(pendingCount && (state == SD_READY || (state == SD_LOW_POWER && (waitTime == 0 || pendingCount == FS_DEFER_QUEUE_LENGTH)))){
+            if(deadlineWake && !FS_clearPowerTimeout()) continue;
+            
+            //stop if the card fails or is pulled in between, the rest is handled like any other pending job
+            uint32_t ran = 0;
+            while(ran < pendingCount && (currState == SD_READY || currState == SD_LOW_POWER)){
+                pending[ran].job(pending[ran].context);
+                ran++;
+            }
+            
+            for(uint32_t i = ran; i < pendingCount; i++) pending[i - ran] = pending[i];
+            pendingCount -= ran;
+            
+            taskENTER_CRITICAL();
+            powerStats.deferredJobsRun += ran;
+            if(deadlineWake) powerStats.deferredDeadlineWakes++;
+            taskEXIT_CRITICAL();
+            continue;
+        }
+        
+        //sleep until something new comes in, the card state changes or the earliest deadline passed
+        ulTaskNotifyTake(pdTRUE, waitTime);
+    }
+}
+
+void FS_getPowerStats(FS_powerStats_t * stats){
+    taskENTER_CRITICAL();
+    *stats = powerStats;
+    //add the time since the current state was entered
+    stats->timeInState[currState] += xTaskGetTickCount() - stateEnteredAt;
+    taskEXIT_CRITICAL();
+    
+    TickType_t total = 0;
+    for(uint32_t i = 0; i < FS_POWER_STATE_COUNT; i++) total += stats->timeInState[i];
+    stats->wakesPerHour = total ? (uint32_t) (((uint64_t) stats->wakes * pdMS_TO_TICKS(3600000)) / total) : 0;
+}
+
 char * FS_newCWD(char * oldPath, char * newPath){
     uint8_t count = 0;
     
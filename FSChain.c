@@ -0,0 +1,109 @@
+#include <xc.h>
+#include <stdint.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "diskio.h"
+#include "ff.h"
+#include "FSChain.h"
+
+/*
+ * FAT cluster chain walker for the modules that read FatFs volumes with disk_readList directly
+ *
+ * FatFs only ever looks at one cluster at a time. Bulk readers instead want to know which consecutive runs of clusters a
+ * file or directory occupies, so they can fetch every run with a single command.
+ *
+ * FatFs keeps one sector in its window (fs->win) that might have been changed without being written yet, so everything
+ * read past FatFs is patched with the window's content. The read and the patch both happen with FatFs's lock held, so it
+ * can't flush or move the window in between.
+ */
+
+/* Takes FatFs's lock of the volume, needed for everything that looks at or changes its state outside of the f_* calls.
+ * Returns 0 if it timed out. Without FF_FS_REENTRANT there is no lock and nothing to do */
+uint32_t FSCH_lock(FATFS * fs){
+#if FF_FS_REENTRANT
+    return ff_req_grant(fs->sobj);
+#else
+    return 1;
+#endif
+}
+
+void FSCH_unlock(FATFS * fs){
+#if FF_FS_REENTRANT
+    ff_rel_grant(fs->sobj);
+#endif
+}
+
+//copies FatFs's window over the sector it holds if that is inside the count sectors in buff. Needs FSCH_lock
+void FSCH_patchFromWindow(FATFS * fs, BYTE * buff, DWORD sector, UINT count){
+    if(fs->winsect >= sector && fs->winsect - sector < count){
+        memcpy(&buff[(fs->winsect - sector) * 512], fs->win, 512);
+    }
+}
+
+DRESULT FSCH_readSectors(FATFS * fs, BYTE * buff, DWORD sector, UINT count){
+    if(!FSCH_lock(fs)) return RES_ERROR;
+    DRESULT res = disk_read(fs->pdrv, buff, sector, count);
+    if(res == RES_OK) FSCH_patchFromWindow(fs, buff, sector, count);
+    FSCH_unlock(fs);
+    return res;
+}
+
+/* Follows the chain starting at startCluster and calls callback for every run of consecutive clusters in it. Returns 
+ * FR_INT_ERR for broken chains. FAT12 isn't supported, as its entries can cross sector boundaries */
+FRESULT FSCH_walk(FATFS * fs, DWORD startCluster, FSCH_runCallback_t callback, void * context){
+    if(fs->fs_type != FS_FAT16 && fs->fs_type != FS_FAT32) return FR_INVALID_PARAMETER;
+    
+    uint32_t fat32 = (fs->fs_type == FS_FAT32);
+    DWORD entriesPerSector = fat32 ? 128 : 256;
+    DWORD endOfChain = fat32 ? 0x0FFFFFF8 : 0xFFF8;
+    
+    BYTE * sector = pvPortMalloc(512);
+    if(sector == NULL) return FR_NOT_ENOUGH_CORE;
+    DWORD cachedSector = 0;     //the FAT never starts at sector 0
+    
+    FRESULT res = FR_OK;
+    DWORD cluster = startCluster;
+    DWORD runStart = startCluster, runLength = 0;
+    DWORD steps = 0;
+    
+    while(1){
+        //a chain can't be longer than the FAT, if it is there is a loop in it
+        if(cluster < 2 || cluster >= fs->n_fatent || ++steps > fs->n_fatent){
+            res = FR_INT_ERR;
+            break;
+        }
+        runLength++;
+        
+        DWORD fatSector = fs->fatbase + cluster / entriesPerSector;
+        if(fatSector != cachedSector){
+            if(FSCH_readSectors(fs, sector, fatSector, 1) != RES_OK){
+                res = FR_DISK_ERR;
+                break;
+            }
+            cachedSector = fatSector;
+        }
+        
+        DWORD next;
+        const BYTE * entry;
+        if(fat32){
+            entry = &sector[(cluster % entriesPerSector) * 4];
+            next = (entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((DWORD) entry[3] << 24)) & 0x0FFFFFFF;
+        }else{
+            entry = &sector[(cluster % entriesPerSector) * 2];
+            next = entry[0] | (entry[1] << 8);
+        }
+        
+        uint32_t end = (next >= endOfChain);
+        if(end || next != cluster + 1){
+            if(!callback(context, runStart, runLength)) break;
+            runStart = next;
+            runLength = 0;
+        }
+        if(end) break;
+        
+        cluster = next;
+    }
+    
+    vPortFree(sector);
+    return res;
+}
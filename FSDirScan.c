@@ -0,0 +1,339 @@
+#include <xc.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "diskio.h"
+#include "ff.h"
+#include "FSChain.h"
+#include "FSDirScan.h"
+
+/*
+ * Bulk directory scan
+ *
+ * f_readdir costs one disk_read per directory sector plus FatFs's overhead for every entry, which adds up to seconds for
+ * directories with thousands of log files. Instead the cluster chain of the directory is fetched with disk_readList,
+ * FSDS_BUFFER_SECTORS at a time with all runs of clusters that fit going into the same list, and the entries are parsed
+ * straight out of the buffer, long names included.
+ *
+ * Changes that FatFs didn't write to the card yet are only seen for the sector that is in its window.
+ */
+
+#define DIR_ATTR        11
+#define DIR_NTRES       12
+#define DIR_CLUSTER_HI  20
+#define DIR_TIME        22
+#define DIR_DATE        24
+#define DIR_CLUSTER_LO  26
+#define DIR_SIZE        28
+#define LFN_CHECKSUM    13
+
+#define ATTR_LFN        0x0F
+#define ATTR_VOLUME     0x08
+#define LFN_LAST        0x40
+#define LFN_MAX_PARTS   20      //255 characters, 13 per entry
+
+#define NTRES_LOWER_BASE    0x08
+#define NTRES_LOWER_EXT     0x10
+
+static const BYTE FSDS_lfnOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+typedef struct{
+    FATFS * fs;
+    const FSDS_filter_t * filter;
+    FSDS_callback_t callback;
+    void * context;
+
+    BYTE * buffer;
+    DLLObject * list;                       //runs queued for the next disk_readList
+    DWORD runSector[FSDS_BUFFER_SECTORS];
+    DWORD runLength[FSDS_BUFFER_SECTORS];
+    uint32_t runs;
+    DWORD queuedSectors;
+
+    WCHAR lfn[LFN_MAX_PARTS * 13 + 1];
+    uint32_t lfnOrder;                      //order of the last long name part, 0 if there is no valid long name
+    BYTE lfnChecksum;
+
+    FSDS_entry_t entry;
+    uint32_t count;
+    uint32_t done;                          //end of the directory reached or the callback wants to stop
+    FRESULT result;
+} FSDS_STATE;
+
+static uint32_t FSDS_matches(const FSDS_filter_t * filter, const FSDS_entry_t * entry){
+    if(filter == NULL) return 1;
+    if(entry->attributes & filter->excludeAttributes) return 0;
+
+    DWORD timestamp = FSDS_TIMESTAMP(entry);
+    if(filter->minTimestamp && timestamp < filter->minTimestamp) return 0;
+    if(filter->maxTimestamp && timestamp > filter->maxTimestamp) return 0;
+
+    if(filter->prefix){
+        const char * name = entry->name;
+        for(const char * p = filter->prefix; *p; p++, name++){
+            if(toupper((unsigned char) *p) != toupper((unsigned char) *name)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void FSDS_parseLFN(FSDS_STATE * s, const BYTE * dir){
+    BYTE order = dir[0];
+
+    if(order & LFN_LAST){
+        //first entry of a new name, the parts are stored in reverse
+        order &= ~LFN_LAST;
+        if(order == 0 || order > LFN_MAX_PARTS){
+            s->lfnOrder = 0;
+            return;
+        }
+        s->lfnChecksum = dir[LFN_CHECKSUM];
+        s->lfn[order * 13] = 0;     //a name that fills the last part completely isn't terminated
+    }else if(s->lfnOrder == 0 || order != s->lfnOrder - 1 || dir[LFN_CHECKSUM] != s->lfnChecksum){
+        s->lfnOrder = 0;
+        return;
+    }
+
+    s->lfnOrder = order;
+    WCHAR * part = &s->lfn[(order - 1) * 13];
+    for(uint32_t i = 0; i < 13; i++) part[i] = dir[FSDS_lfnOffsets[i]] | (dir[FSDS_lfnOffsets[i] + 1] << 8);
+}
+
+static void FSDS_parseSFN(FSDS_STATE * s, const BYTE * dir){
+    FSDS_entry_t * entry = &s->entry;
+
+    //8.3 name, the NT reserved byte says if base and extension are all lower case
+    char * c = entry->shortName;
+    for(uint32_t i = 0; i < 8 && dir[i] != ' '; i++){
+        BYTE ch = (i == 0 && dir[i] == 0x05) ? 0xE5 : dir[i];
+        *c++ = (dir[DIR_NTRES] & NTRES_LOWER_BASE) ? tolower(ch) : ch;
+    }
+    if(dir[8] != ' '){
+        *c++ = '.';
+        for(uint32_t i = 8; i < 11 && dir[i] != ' '; i++) *c++ = (dir[DIR_NTRES] & NTRES_LOWER_EXT) ? tolower(dir[i]) : dir[i];
+    }
+    *c = 0;
+
+    //the long name only belongs to this entry if it is complete and its checksum matches the short name
+    BYTE sum = 0;
+    for(uint32_t i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + dir[i];
+
+    if(s->lfnOrder == 1 && sum == s->lfnChecksum){
+        uint32_t i;
+        for(i = 0; i < FF_MAX_LFN && s->lfn[i] != 0 && s->lfn[i] != 0xFFFF; i++){
+            WCHAR ch = s->lfn[i];
+            if(ch >= 0x80){
+                ch = ff_uni2oem(ch, FF_CODE_PAGE);
+                if(ch == 0 || ch > 0xFF) ch = '?';
+            }
+            entry->name[i] = ch;
+        }
+        entry->name[i] = 0;
+    }else{
+        strcpy(entry->name, entry->shortName);
+    }
+    s->lfnOrder = 0;
+
+    entry->attributes = dir[DIR_ATTR];
+    entry->time = dir[DIR_TIME] | (dir[DIR_TIME + 1] << 8);
+    entry->date = dir[DIR_DATE] | (dir[DIR_DATE + 1] << 8);
+    entry->startCluster = dir[DIR_CLUSTER_LO] | (dir[DIR_CLUSTER_LO + 1] << 8) | ((DWORD) dir[DIR_CLUSTER_HI] << 16) | ((DWORD) dir[DIR_CLUSTER_HI + 1] << 24);
+    entry->size = dir[DIR_SIZE] | (dir[DIR_SIZE + 1] << 8) | ((DWORD) dir[DIR_SIZE + 2] << 16) | ((DWORD) dir[DIR_SIZE + 3] << 24);
+
+    if(!FSDS_matches(s->filter, entry)) return;
+
+    s->count++;
+    if(!s->callback(s->context, entry)) s->done = 1;
+}
+
+static void FSDS_parse(FSDS_STATE * s, const BYTE * dir){
+    if(dir[0] == 0){
+        //nothing follows the first unused entry
+        s->done = 1;
+        return;
+    }
+
+    BYTE attr = dir[DIR_ATTR] & 0x3F;
+    if(dir[0] == 0xE5){
+        s->lfnOrder = 0;                //deleted
+    }else if(attr == ATTR_LFN){
+        FSDS_parseLFN(s, dir);
+    }else if((attr & ATTR_VOLUME) || dir[0] == '.'){
+        s->lfnOrder = 0;                //volume label and dot entries
+    }else{
+        FSDS_parseSFN(s, dir);
+    }
+}
+
+static void FSDS_flush(FSDS_STATE * s){
+    if(s->queuedSectors == 0) return;
+
+    //FatFs must not flush or move its window between the read and the patch
+    if(!FSCH_lock(s->fs)){
+        s->result = FR_TIMEOUT;
+        s->done = 1;
+        return;
+    }
+
+    DRESULT res = disk_readList(s->fs->pdrv, s->buffer, s->list);
+    s->list = NULL;     //disk_readList frees it
+
+    if(res == RES_OK){
+        BYTE * sectors = s->buffer;
+        for(uint32_t i = 0; i < s->runs; i++){
+            FSCH_patchFromWindow(s->fs, sectors, s->runSector[i], s->runLength[i]);
+            sectors += s->runLength[i] * 512;
+        }
+    }
+    FSCH_unlock(s->fs);
+
+    if(res != RES_OK){
+        s->result = FR_DISK_ERR;
+        s->done = 1;
+    }else{
+        for(DWORD offset = 0; offset < s->queuedSectors * 512 && !s->done; offset += 32) FSDS_parse(s, &s->buffer[offset]);
+    }
+
+    s->queuedSectors = 0;
+    s->runs = 0;
+}
+
+//adds the sectors to the next disk_readList, which runs once the buffer is full
+static void FSDS_queue(FSDS_STATE * s, DWORD sector, DWORD count){
+    while(count && !s->done){
+        DWORD length = FSDS_BUFFER_SECTORS - s->queuedSectors;
+        if(length > count) length = count;
+
+        if(s->list == NULL) s->list = DLL_create();
+        ff_readListData_t * entry = pvPortMalloc(sizeof(ff_readListData_t));
+        entry->startSector = sector;
+        entry->startByte = 0;
+        entry->bytesToRead = length * 512;
+        DLL_add(entry, s->list);
+
+        s->runSector[s->runs] = sector;
+        s->runLength[s->runs++] = length;
+        s->queuedSectors += length;
+        sector += length;
+        count -= length;
+
+        if(s->queuedSectors == FSDS_BUFFER_SECTORS) FSDS_flush(s);
+    }
+}
+
+static uint32_t FSDS_queueRun(void * context, DWORD firstCluster, DWORD clusterCount){
+    FSDS_STATE * s = (FSDS_STATE *) context;
+    FSDS_queue(s, s->fs->database + (firstCluster - 2) * s->fs->csize, clusterCount * s->fs->csize);
+    return !s->done;
+}
+
+/* Calls callback for every entry of the directory at path that passes filter (may be NULL). The number of entries that
+ * did is stored in entryCount if it isn't NULL */
+FRESULT FSDS_scan(const char * path, const FSDS_filter_t * filter, FSDS_callback_t callback, void * context, uint32_t * entryCount){
+    //let FatFs resolve the path
+    DIR * dir = pvPortMalloc(sizeof(DIR));
+    if(dir == NULL) return FR_NOT_ENOUGH_CORE;
+    FRESULT res = f_opendir(dir, path);
+    FATFS * fs = dir->obj.fs;
+    DWORD cluster = dir->obj.sclust;
+    if(res == FR_OK) f_closedir(dir);
+    vPortFree(dir);
+    if(res != FR_OK) return res;
+
+    FSDS_STATE * s = pvPortMalloc(sizeof(FSDS_STATE));
+    BYTE * buffer = pvPortMalloc(FSDS_BUFFER_SECTORS * 512);
+    if(s == NULL || buffer == NULL){
+        vPortFree(s);
+        vPortFree(buffer);
+        return FR_NOT_ENOUGH_CORE;
+    }
+
+    memset(s, 0, sizeof(FSDS_STATE));
+    s->fs = fs;
+    s->filter = filter;
+    s->callback = callback;
+    s->context = context;
+    s->buffer = buffer;
+    s->result = FR_OK;
+
+    if(cluster == 0 && fs->fs_type != FS_FAT32){
+        //the root directory of FAT12/16 is a fixed area in front of the data
+        FSDS_queue(s, fs->dirbase, fs->n_rootdir * 32 / 512);
+    }else{
+        if(cluster == 0) cluster = fs->dirbase;     //FAT32 keeps the first cluster of the root directory there
+        res = FSCH_walk(fs, cluster, FSDS_queueRun, s);
+        if(res != FR_OK) s->result = res;
+    }
+    if(!s->done) FSDS_flush(s);
+
+    //stopped early, forget what was queued
+    if(s->list){
+        ff_readListData_t * currObj;
+        while((currObj = DLL_pop(s->list))) vPortFree(currObj);
+        DLL_free(s->list);
+    }
+
+    res = s->result;
+    if(entryCount) *entryCount = s->count;
+
+    vPortFree(buffer);
+    vPortFree(s);
+    return res;
+}
+
+static uint32_t FSDS_keepNewest(void * context, const FSDS_entry_t * entry){
+    FSDS_entry_t * newest = (FSDS_entry_t *) context;
+    if(newest->name[0] == 0 || FSDS_TIMESTAMP(entry) > FSDS_TIMESTAMP(newest)) memcpy(newest, entry, sizeof(FSDS_entry_t));
+    return 1;
+}
+
+//finds the most recently modified entry passing filter, returns FR_NO_FILE if there is none
+FRESULT FSDS_findNewest(const char * path, const FSDS_filter_t * filter, FSDS_entry_t * newest){
+    newest->name[0] = 0;
+
+    FRESULT res = FSDS_scan(path, filter, FSDS_keepNewest, newest, NULL);
+    if(res == FR_OK && newest->name[0] == 0) res = FR_NO_FILE;
+    return res;
+}
+
+static uint32_t FSDS_countEntry(void * context, const FSDS_entry_t * entry){
+    return 1;
+}
+
+static uint32_t FSDS_rate(uint32_t entries, TickType_t ticks){
+    if(ticks == 0) ticks = 1;
+    return ((uint64_t) entries * configTICK_RATE_HZ) / ticks;
+}
+
+//lists path once with FSDS_scan and once with f_readdir and reports the entries per second of both
+FRESULT FSDS_benchmark(const char * path, uint32_t * scanRate, uint32_t * readdirRate){
+    uint32_t count = 0;
+    TickType_t start = xTaskGetTickCount();
+    FRESULT res = FSDS_scan(path, NULL, FSDS_countEntry, NULL, &count);
+    if(res != FR_OK) return res;
+    *scanRate = FSDS_rate(count, xTaskGetTickCount() - start);
+
+    DIR * dir = pvPortMalloc(sizeof(DIR));
+    FILINFO * info = pvPortMalloc(sizeof(FILINFO));
+    if(dir == NULL || info == NULL){
+        vPortFree(dir);
+        vPortFree(info);
+        return FR_NOT_ENOUGH_CORE;
+    }
+
+    count = 0;
+    start = xTaskGetTickCount();
+    res = f_opendir(dir, path);
+    if(res == FR_OK){
+        while((res = f_readdir(dir, info)) == FR_OK && info->fname[0] != 0) count++;
+        f_closedir(dir);
+    }
+    *readdirRate = FSDS_rate(count, xTaskGetTickCount() - start);
+
+    vPortFree(info);
+    vPortFree(dir);
+    return res;
+}
@@ -0,0 +1,274 @@
+#include <xc.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "diskio.h"
+#include "ff.h"
+#include "FSFormat.h"
+
+/*
+ * FAT32 format that matches the layout of the card
+ *
+ * Cards formatted on a pc often end up with a FAT and data area that don't start on an allocation unit boundary, so every
+ * cluster write the logger does touches two AUs and sustained writes get a lot slower. This follows the sd spec's file
+ * system layout instead: the partition starts after the first AU, the FATs are grown until the data area starts on an AU
+ * boundary as well, and the cluster size divides the AU.
+ *
+ * The whole card is bulk erased with CTRL_TRIM instead of writing zeros. The FATs only get written with zeros if the card
+ * reads erased sectors as 0xFF (DATA_STAT_AFTER_ERASE in the SCR) or couldn't erase, everything else is a handful of sectors.
+ */
+
+#if _READONLY == 0
+
+#define FSFMT_RESERVED_SECTORS  32
+#define FSFMT_MIN_CLUSTERS      65526       //less and FatFs mounts the volume as FAT16
+#define FSFMT_MAX_CLUSTERS      0x0FFFFFF5
+
+#define FSFMT_FSINFO_SECTOR     1
+#define FSFMT_BACKUP_SECTOR     6
+
+static void FSFMT_setWord(BYTE * ptr, WORD value){
+    ptr[0] = value;
+    ptr[1] = value >> 8;
+}
+
+static void FSFMT_setDword(BYTE * ptr, DWORD value){
+    FSFMT_setWord(ptr, value);
+    FSFMT_setWord(ptr + 2, value >> 16);
+}
+
+//picks cluster size and FAT size so the data area is aligned, for the card size and alignment in layout
+static FRESULT FSFMT_plan(FSFMT_layout_t * layout){
+    DWORD alignment = layout->alignment;
+
+    //the MBR gets the whole first AU
+    if(layout->sectorCount <= alignment * 2) return FR_MKFS_ABORTED;
+    layout->partitionStart = alignment;
+    layout->partitionSize = layout->sectorCount - alignment;
+
+    for(DWORD clusterSize = FSFMT_CLUSTER_SECTORS; clusterSize; clusterSize /= 2){
+        DWORD reserved = FSFMT_RESERVED_SECTORS;
+        DWORD fatSize = (((uint64_t) layout->partitionSize / clusterSize + 2) * 4 + 511) / 512;
+
+        //grow the FATs until the data area starts on an AU boundary, an odd gap goes into the reserved area
+        DWORD gap = (alignment - (layout->partitionStart + reserved + 2 * fatSize) % alignment) % alignment;
+        fatSize += gap / 2;
+        reserved += gap % 2;
+
+        if(reserved + 2 * fatSize + clusterSize > layout->partitionSize) continue;
+        DWORD clusters = (layout->partitionSize - reserved - 2 * fatSize) / clusterSize;
+        if(clusters > FSFMT_MAX_CLUSTERS) return FR_MKFS_ABORTED;
+        if(clusters < FSFMT_MIN_CLUSTERS) continue;
+
+        layout->clusterSize = clusterSize;
+        layout->clusterCount = clusters;
+        layout->reservedSectors = reserved;
+        layout->fatSize = fatSize;
+        layout->dataStart = layout->partitionStart + reserved + 2 * fatSize;
+        return FR_OK;
+    }
+
+    return FR_MKFS_ABORTED;
+}
+
+static DRESULT FSFMT_writeZeros(BYTE pdrv, BYTE * buff, DWORD sector, DWORD count){
+    memset(buff, 0, FSFMT_BUFFER_SECTORS * 512);
+
+    while(count){
+        UINT length = (count > FSFMT_BUFFER_SECTORS) ? FSFMT_BUFFER_SECTORS : count;
+        DRESULT res = disk_write(pdrv, buff, sector, length);
+        if(res != RES_OK) return res;
+        sector += length;
+        count -= length;
+    }
+
+    return RES_OK;
+}
+
+//copies label into an 11 character, space padded directory name
+static void FSFMT_setLabel(BYTE * dst, const char * label){
+    memset(dst, ' ', 11);
+    for(uint32_t i = 0; i < 11 && label[i]; i++) dst[i] = toupper((unsigned char) label[i]);
+}
+
+static void FSFMT_buildMBR(BYTE * buff, const FSFMT_layout_t * layout){
+    memset(buff, 0, 512);
+
+    //one FAT32 (LBA) partition, the CHS fields say to use the LBA ones
+    BYTE * entry = &buff[446];
+    entry[1] = 0xFE; entry[2] = 0xFF; entry[3] = 0xFF;
+    entry[4] = 0x0C;
+    entry[5] = 0xFE; entry[6] = 0xFF; entry[7] = 0xFF;
+    FSFMT_setDword(&entry[8], layout->partitionStart);
+    FSFMT_setDword(&entry[12], layout->partitionSize);
+
+    FSFMT_setWord(&buff[510], 0xAA55);
+}
+
+static void FSFMT_buildVBR(BYTE * buff, const FSFMT_layout_t * layout, const char * label){
+    memset(buff, 0, 512);
+
+    memcpy(&buff[0], "\xEB\x58\x90" "MSDOS5.0", 11);
+    FSFMT_setWord(&buff[11], 512);                          //bytes per sector
+    buff[13] = layout->clusterSize;
+    FSFMT_setWord(&buff[14], layout->reservedSectors);
+    buff[16] = 2;                                           //FATs
+    buff[21] = 0xF8;                                        //media
+    FSFMT_setWord(&buff[24], 63);                           //sectors per track and heads, meaningless for sd cards
+    FSFMT_setWord(&buff[26], 255);
+    FSFMT_setDword(&buff[28], layout->partitionStart);      //hidden sectors
+    FSFMT_setDword(&buff[32], layout->partitionSize);
+    FSFMT_setDword(&buff[36], layout->fatSize);
+    FSFMT_setDword(&buff[44], 2);                           //root directory cluster
+    FSFMT_setWord(&buff[48], FSFMT_FSINFO_SECTOR);
+    FSFMT_setWord(&buff[50], FSFMT_BACKUP_SECTOR);
+    buff[64] = 0x80;                                        //drive number
+    buff[66] = 0x29;                                        //extended boot signature
+    FSFMT_setDword(&buff[67], _CP0_GET_COUNT() ^ xTaskGetTickCount());   //volume id
+    FSFMT_setLabel(&buff[71], label ? label : "NO NAME");
+    memcpy(&buff[82], "FAT32   ", 8);
+
+    FSFMT_setWord(&buff[510], 0xAA55);
+}
+
+static void FSFMT_buildFSInfo(BYTE * buff, const FSFMT_layout_t * layout){
+    memset(buff, 0, 512);
+
+    FSFMT_setDword(&buff[0], 0x41615252);
+    FSFMT_setDword(&buff[484], 0x61417272);
+    FSFMT_setDword(&buff[488], layout->clusterCount - 1);  //everything but the root directory is free
+    FSFMT_setDword(&buff[492], 3);                          //next free cluster
+    FSFMT_setDword(&buff[508], 0xAA550000);
+}
+
+static DRESULT FSFMT_write(FSFMT_layout_t * layout, BYTE pdrv, BYTE * buff, const char * label){
+    DRESULT res;
+    DWORD fatStart = layout->partitionStart + layout->reservedSectors;
+
+    //bulk erase the card, it is the fastest way to get rid of the old contents and gives the card free blocks to write to
+    layout->erased = 1;
+    for(DWORD sector = 0; sector < layout->sectorCount; sector += FSFMT_ERASE_SECTORS){
+        DWORD range[2] = {sector, sector + FSFMT_ERASE_SECTORS - 1};
+        if(range[1] >= layout->sectorCount) range[1] = layout->sectorCount - 1;
+
+        if(disk_ioctl(pdrv, CTRL_TRIM, range) != RES_OK){
+            layout->erased = 0;
+            break;
+        }
+    }
+
+    BYTE erasedValue = 0xFF;
+    if(layout->erased && disk_ioctl(pdrv, MMC_GET_ERASED, &erasedValue) != RES_OK) erasedValue = 0xFF;
+    layout->fatsZeroed = !layout->erased || erasedValue != 0x00;
+
+    FSFMT_buildMBR(buff, layout);
+    if((res = disk_write(pdrv, buff, 0, 1)) != RES_OK) return res;
+
+    //boot sector and FSInfo, plus their backups
+    FSFMT_buildVBR(buff, layout, label);
+    if((res = disk_write(pdrv, buff, layout->partitionStart, 1)) != RES_OK) return res;
+    if((res = disk_write(pdrv, buff, layout->partitionStart + FSFMT_BACKUP_SECTOR, 1)) != RES_OK) return res;
+
+    FSFMT_buildFSInfo(buff, layout);
+    if((res = disk_write(pdrv, buff, layout->partitionStart + FSFMT_FSINFO_SECTOR, 1)) != RES_OK) return res;
+    if((res = disk_write(pdrv, buff, layout->partitionStart + FSFMT_BACKUP_SECTOR + FSFMT_FSINFO_SECTOR, 1)) != RES_OK) return res;
+
+    //FATs and root directory, only the first sector of each if erasing already zeroed them
+    if(layout->fatsZeroed){
+        if((res = FSFMT_writeZeros(pdrv, buff, fatStart, 2 * layout->fatSize)) != RES_OK) return res;
+        if((res = FSFMT_writeZeros(pdrv, buff, layout->dataStart, layout->clusterSize)) != RES_OK) return res;
+    }
+
+    memset(buff, 0, 512);
+    FSFMT_setDword(&buff[0], 0x0FFFFFF8);       //media type
+    FSFMT_setDword(&buff[4], 0x0FFFFFFF);
+    FSFMT_setDword(&buff[8], 0x0FFFFFFF);       //root directory, a single cluster
+    if((res = disk_write(pdrv, buff, fatStart, 1)) != RES_OK) return res;
+    if((res = disk_write(pdrv, buff, fatStart + layout->fatSize, 1)) != RES_OK) return res;
+
+    memset(buff, 0, 512);
+    if(label){
+        FSFMT_setLabel(&buff[0], label);
+        buff[11] = AM_VOL;
+    }
+    if((res = disk_write(pdrv, buff, layout->dataStart, 1)) != RES_OK) return res;
+
+    return disk_ioctl(pdrv, CTRL_SYNC, NULL);
+}
+
+/* Formats drive pdrv as a single FAT32 partition aligned to the card's AU. label may be NULL. Everything on the card is
+ * lost! The volume must not be mounted while this runs, mount it again afterwards. layout may be NULL */
+FRESULT FSFMT_format(BYTE pdrv, const char * label, FSFMT_layout_t * layout){
+    FSFMT_layout_t l;
+    memset(&l, 0, sizeof(FSFMT_layout_t));
+    TickType_t start = xTaskGetTickCount();
+
+    if(disk_initialize(pdrv) & STA_NOINIT) return FR_NOT_READY;
+    if(disk_ioctl(pdrv, GET_SECTOR_COUNT, &l.sectorCount) != RES_OK) return FR_DISK_ERR;
+    if(disk_ioctl(pdrv, GET_BLOCK_SIZE, &l.auSize) != RES_OK) l.auSize = 0;
+
+    //AUs larger than the boundary unit are multiples of it, so the larger one satisfies both
+    l.alignment = (l.auSize > FSFMT_DEFAULT_ALIGNMENT) ? l.auSize : FSFMT_DEFAULT_ALIGNMENT;
+
+    FRESULT res = FSFMT_plan(&l);
+    if(res != FR_OK) return res;
+
+    BYTE * buff = pvPortMalloc(FSFMT_BUFFER_SECTORS * 512);
+    if(buff == NULL) return FR_NOT_ENOUGH_CORE;
+    if(FSFMT_write(&l, pdrv, buff, label) != RES_OK) res = FR_DISK_ERR;
+    vPortFree(buff);
+
+    l.duration = xTaskGetTickCount() - start;
+    if(layout) memcpy(layout, &l, sizeof(FSFMT_layout_t));
+    return res;
+}
+
+#endif
+
+/* Writes bytes to a new file at path in pieces of chunkSize like a logger would, calling f_sync every
+ * FSFMT_BENCH_SYNC_CHUNKS chunks, and deletes it again. Returns the throughput in kB/s or 0 if anything failed. The
+ * longest f_write/f_sync is stored in worstChunkUs if it isn't NULL. Run it on a pc formatted card, format it with
+ * FSFMT_format and run it again to compare */
+uint32_t FSFMT_benchmark(const char * path, UINT chunkSize, DWORD bytes, uint32_t * worstChunkUs){
+    FIL * file = pvPortMalloc(sizeof(FIL));
+    BYTE * buff = pvPortMalloc(chunkSize);
+    if(file == NULL || buff == NULL || chunkSize == 0){
+        vPortFree(file);
+        vPortFree(buff);
+        return 0;
+    }
+    for(UINT i = 0; i < chunkSize; i++) buff[i] = i;
+
+    uint32_t worst = 0;
+    FRESULT res = f_open(file, path, FA_WRITE | FA_CREATE_ALWAYS);
+    TickType_t start = xTaskGetTickCount();
+
+    if(res == FR_OK){
+        uint32_t chunks = 0;
+        for(DWORD done = 0; done < bytes && res == FR_OK; done += chunkSize){
+            UINT written;
+            uint32_t chunkStart = _CP0_GET_COUNT();
+
+            res = f_write(file, buff, chunkSize, &written);
+            if(res == FR_OK && written != chunkSize) res = FR_DENIED;   //volume full
+            if(res == FR_OK && ++chunks % FSFMT_BENCH_SYNC_CHUNKS == 0) res = f_sync(file);
+
+            uint32_t chunkTime = _CP0_GET_COUNT() - chunkStart;
+            if(chunkTime > worst) worst = chunkTime;
+        }
+        if(f_close(file) != FR_OK) res = FR_DISK_ERR;
+    }
+
+    TickType_t ticks = xTaskGetTickCount() - start;
+    if(ticks == 0) ticks = 1;
+
+    f_unlink(path);
+    vPortFree(buff);
+    vPortFree(file);
+
+    if(worstChunkUs) *worstChunkUs = worst / (configCPU_CLOCK_HZ / 2000000);
+    if(res != FR_OK) return 0;
+    return ((uint64_t) bytes * configTICK_RATE_HZ) / (1024 * (uint64_t) ticks);
+}
@@ -0,0 +1,301 @@
+#include <xc.h>
+#include <stdint.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "diskio.h"
+#include "ff.h"
+#include "FSChain.h"
+#include "FSFreeMap.h"
+
+/*
+ * Free cluster map for FAT32 volumes
+ *
+ * On big cards FatFs has to walk the whole FAT for f_getfree and for the first allocation after mounting, which takes
+ * seconds. Instead a low priority task reads the FAT in bulk with disk_readList and keeps the number of free clusters of
+ * every FAT sector. That is one byte per 128 clusters (8kB for a 32GB card with 32kB clusters). FS.c starts it once the
+ * card was woken up for the first time after mounting, so inserting a card doesn't power it up on its own.
+ *
+ * The map is kept up to date by looking at every FAT sector that goes through disk_write. Once complete it fills in
+ * FatFs's free cluster count and points its allocator at a free region, so neither needs to scan anymore. FatFs's lock
+ * is always taken before FSFM_mutex, as disk_write gets called with it held.
+ */
+
+#define FSFM_ENTRIES_PER_SECTOR 128     //FAT32 entries are 4 bytes
+#define FSFM_CHUNK_SECTORS      16      //FAT sectors read per disk_readList call
+#define FSFM_MAX_RETRIES        5
+
+typedef struct{
+    FATFS * fs;
+    uint32_t generation;    //counts mounts and unmounts, FatFs reuses the same FATFS for a new volume
+    uint8_t * freeCount;    //free clusters of each FAT sector
+    DWORD fatSectors;
+    DWORD scanned;          //FAT sectors already in the map, it is complete once this reaches fatSectors
+    DWORD freeTotal;
+    DWORD scanStart;        //FAT sectors the builder is reading at the moment
+    DWORD scanEnd;
+    uint32_t scanDirty;     //one of them was written while the read was going on
+} FSFM_STATE;
+
+static FSFM_STATE FSFM;
+static SemaphoreHandle_t FSFM_mutex;
+static TaskHandle_t FSFM_taskHandle;
+
+static void FSFM_task(void * params);
+
+//counts the free entries of FAT sector index
+static uint32_t FSFM_countFree(const BYTE * sector, DWORD index){
+    DWORD cluster = index * FSFM_ENTRIES_PER_SECTOR;
+    uint32_t free = 0;
+
+    for(uint32_t i = 0; i < FSFM_ENTRIES_PER_SECTOR; i++, cluster++){
+        if(cluster < 2) continue;                       //the first two entries are reserved
+        if(cluster >= FSFM.fs->n_fatent) break;         //the last FAT sector might not be used completely
+
+        //upper 4 bits of an entry are reserved
+        const BYTE * entry = &sector[i * 4];
+        if((entry[0] | entry[1] | entry[2] | (entry[3] & 0x0f)) == 0) free++;
+    }
+
+    return free;
+}
+
+void FSFM_start(FATFS * fs){
+    if(FSFM_mutex == NULL){
+        FSFM_mutex = xSemaphoreCreateMutex();
+        xTaskCreate(FSFM_task, "fs map", configMINIMAL_STACK_SIZE + 200, NULL, tskIDLE_PRIORITY + 1, &FSFM_taskHandle);
+    }
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    FSFM.fs = fs;
+    FSFM.generation++;
+    xSemaphoreGive(FSFM_mutex);
+
+    xTaskNotifyGive(FSFM_taskHandle);
+}
+
+//forgets the map, called when the volume is unmounted
+void FSFM_stop(){
+    if(FSFM_mutex == NULL) return;
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    FSFM.fs = NULL;
+    FSFM.generation++;
+    vPortFree(FSFM.freeCount);
+    FSFM.freeCount = NULL;
+    FSFM.scanned = 0;
+    xSemaphoreGive(FSFM_mutex);
+}
+
+//called by the driver for every successful write, updates the map if FAT sectors were written
+void FSFM_sectorWritten(BYTE pdrv, DWORD sector, const BYTE * buff, UINT count){
+    //quick check without the mutex, there is nothing to do most of the time
+    if(FSFM_mutex == NULL || FSFM.freeCount == NULL) return;
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+
+    FATFS * fs = FSFM.fs;
+    if(fs != NULL && fs->pdrv == pdrv && FSFM.freeCount != NULL && sector + count > fs->fatbase){
+        for(UINT i = 0; i < count; i++){
+            if(sector + i < fs->fatbase) continue;
+
+            DWORD index = sector + i - fs->fatbase;
+            if(index >= FSFM.fatSectors) break;
+
+            if(index < FSFM.scanned){
+                uint32_t free = FSFM_countFree(&buff[i * 512], index);
+                FSFM.freeTotal = FSFM.freeTotal - FSFM.freeCount[index] + free;
+                FSFM.freeCount[index] = free;
+            }else if(index >= FSFM.scanStart && index < FSFM.scanEnd){
+                //the builder might have read the old content, make it read the chunk again
+                FSFM.scanDirty = 1;
+            }
+        }
+    }
+
+    xSemaphoreGive(FSFM_mutex);
+}
+
+//returns 1 and the number of free clusters if the map is complete
+uint32_t FSFM_getFree(DWORD * clusters){
+    uint32_t ret = 0;
+    if(FSFM_mutex == NULL) return 0;
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    if(FSFM.fs != NULL && FSFM.freeCount != NULL && FSFM.scanned == FSFM.fatSectors){
+        *clusters = FSFM.freeTotal;
+        ret = 1;
+    }
+    xSemaphoreGive(FSFM_mutex);
+
+    return ret;
+}
+
+static uint32_t FSFM_findExtentLocked(DWORD clusters, DWORD * startCluster){
+    if(FSFM.fs == NULL || FSFM.freeCount == NULL || FSFM.scanned != FSFM.fatSectors) return 0;
+
+    //only completely free FAT sectors are known to be contiguous
+    DWORD sectorsNeeded = (clusters + FSFM_ENTRIES_PER_SECTOR - 1) / FSFM_ENTRIES_PER_SECTOR;
+    DWORD runStart = 0, runLength = 0;
+
+    for(DWORD index = 0; index < FSFM.fatSectors; index++){
+        if(FSFM.freeCount[index] != FSFM_ENTRIES_PER_SECTOR){
+            runLength = 0;
+            continue;
+        }
+
+        if(runLength++ == 0) runStart = index;
+        if(runLength >= sectorsNeeded){
+            *startCluster = runStart * FSFM_ENTRIES_PER_SECTOR;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//finds a contiguous range of at least the given number of free clusters. Returns 0 if there is none or the map isn't ready
+uint32_t FSFM_findExtent(DWORD clusters, DWORD * startCluster){
+    if(FSFM_mutex == NULL) return 0;
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    uint32_t ret = FSFM_findExtentLocked(clusters, startCluster);
+    xSemaphoreGive(FSFM_mutex);
+
+    return ret;
+}
+
+//points FatFs's allocator at a free range of at least the given size, so the next file gets contiguous clusters
+uint32_t FSFM_setAllocationHint(DWORD clusters){
+    DWORD start;
+    if(FSFM_mutex == NULL) return 0;
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    FATFS * fs = FSFM.fs;
+    uint32_t generation = FSFM.generation;
+    xSemaphoreGive(FSFM_mutex);
+    if(fs == NULL || !FSCH_lock(fs)) return 0;
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    uint32_t ret = (FSFM.generation == generation) && FSFM_findExtentLocked(clusters, &start);
+    if(ret) fs->last_clst = start - 1;   //FatFs starts searching after last_clst
+    xSemaphoreGive(FSFM_mutex);
+
+    FSCH_unlock(fs);
+    return ret;
+}
+
+static void FSFM_build(){
+    //the map belongs to this mount, an unmount or remount in the meantime bumps the generation and the build stops
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    FATFS * fs = FSFM.fs;
+    uint32_t generation = FSFM.generation;
+    xSemaphoreGive(FSFM_mutex);
+    if(fs == NULL) return;
+
+    //f_mount only registers the volume, opening the root directory makes sure it is actually mounted
+    DIR * dir = pvPortMalloc(sizeof(DIR));
+    FRESULT mountResult = f_opendir(dir, "/");
+    if(mountResult == FR_OK) f_closedir(dir);
+    vPortFree(dir);
+
+    //small FATs are scanned quickly enough by FatFs itself
+    if(mountResult != FR_OK || fs->fs_type != FS_FAT32) return;
+
+    DWORD fatSectors = (fs->n_fatent + FSFM_ENTRIES_PER_SECTOR - 1) / FSFM_ENTRIES_PER_SECTOR;
+    uint8_t * map = pvPortMalloc(fatSectors);
+    BYTE * buffer = pvPortMalloc(FSFM_CHUNK_SECTORS * 512);
+
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    uint32_t valid = (FSFM.generation == generation) && map != NULL && buffer != NULL;
+    if(valid){
+        vPortFree(FSFM.freeCount);
+        FSFM.freeCount = map;
+        FSFM.fatSectors = fatSectors;
+        FSFM.scanned = 0;
+        FSFM.freeTotal = 0;
+    }
+    xSemaphoreGive(FSFM_mutex);
+
+    if(!valid){
+        vPortFree(map);
+        vPortFree(buffer);
+        return;
+    }
+
+    uint32_t retries = 0;
+    DWORD index = 0;
+    while(index < fatSectors){
+        DWORD count = fatSectors - index;
+        if(count > FSFM_CHUNK_SECTORS) count = FSFM_CHUNK_SECTORS;
+
+        xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+        valid = (FSFM.generation == generation);
+        FSFM.scanStart = index;
+        FSFM.scanEnd = index + count;
+        FSFM.scanDirty = 0;
+        xSemaphoreGive(FSFM_mutex);
+        if(!valid) break;
+
+        DLLObject * list = DLL_create();
+        ff_readListData_t * entry = pvPortMalloc(sizeof(ff_readListData_t));
+        entry->startSector = fs->fatbase + index;
+        entry->startByte = 0;
+        entry->bytesToRead = count * 512;
+        DLL_add(entry, list);
+
+        DRESULT res = disk_readList(fs->pdrv, buffer, list);
+
+        xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+        valid = (FSFM.generation == generation);
+        uint32_t done = valid && res == RES_OK && !FSFM.scanDirty;
+        if(done){
+            for(DWORD i = 0; i < count; i++){
+                FSFM.freeCount[index + i] = FSFM_countFree(&buffer[i * 512], index + i);
+                FSFM.freeTotal += FSFM.freeCount[index + i];
+            }
+            FSFM.scanned = index + count;
+        }
+        FSFM.scanStart = FSFM.scanEnd = 0;
+        xSemaphoreGive(FSFM_mutex);
+
+        if(!valid) break;
+        if(done){
+            index += count;
+        }else if(res != RES_OK){
+            if(++retries > FSFM_MAX_RETRIES) break;
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+    }
+
+    vPortFree(buffer);
+
+    //map complete, hand the results to FatFs unless it already knows them
+    if(!FSCH_lock(fs)) return;
+    xSemaphoreTake(FSFM_mutex, portMAX_DELAY);
+    if(FSFM.generation == generation && FSFM.scanned == fatSectors){
+        //a FAT sector FatFs changed in its window isn't on the card yet, the map has to count its current content
+        DWORD windowIndex = fs->winsect - fs->fatbase;
+        if(fs->wflag && fs->winsect >= fs->fatbase && windowIndex < fatSectors){
+            uint32_t free = FSFM_countFree(fs->win, windowIndex);
+            FSFM.freeTotal = FSFM.freeTotal - FSFM.freeCount[windowIndex] + free;
+            FSFM.freeCount[windowIndex] = free;
+        }
+
+        if(fs->free_clst > fs->n_fatent - 2) fs->free_clst = FSFM.freeTotal;
+
+        DWORD start;
+        if((fs->last_clst < 2 || fs->last_clst >= fs->n_fatent) && FSFM_findExtentLocked(1, &start)) fs->last_clst = start - 1;
+    }
+    xSemaphoreGive(FSFM_mutex);
+    FSCH_unlock(fs);
+}
+
+static void FSFM_task(void * params){
+    while(1){
+        //wait until a volume was mounted and the card woken up
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        FSFM_build();
+    }
+}
@@ -0,0 +1,221 @@
+#include <xc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "diskio.h"
+#include "ff.h"
+#include "FSChain.h"
+#include "assetPack.h"
+
+/*
+ * Packed asset archives
+ *
+ * Opening an asset through FatFs means a directory lookup and a FAT walk before the first byte can be read, which for
+ * small assets costs a lot more than the read itself. Archives instead have to be contiguous on the card (checked once by
+ * APK_open), so the offset of an asset maps straight to a sector and the readList for it can be built from the index
+ * alone.
+ *
+ * Names aren't stored, the index only has two independent hashes of each. The packer makes sure no two assets share the
+ * first one, which the index is sorted by. The second one is checked on every lookup, so a name that isn't in the archive
+ * only hits an unrelated asset if both of its hashes happen to match.
+ */
+
+#define APK_PATH_LENGTH 256
+
+typedef struct{
+    uint32_t runs;
+    DWORD clusters;
+} APK_chain_t;
+
+static uint32_t APK_countRun(void * context, DWORD firstCluster, DWORD clusterCount){
+    APK_chain_t * chain = (APK_chain_t *) context;
+    chain->runs++;
+    chain->clusters += clusterCount;
+    return chain->runs == 1;    //a second run means it is fragmented, no need to look further
+}
+
+//finds the sector the archive starts at, only works if it occupies a single run of clusters
+static FRESULT APK_locate(APK_archive_t * archive, FIL * file){
+    FATFS * fs = file->obj.fs;
+    DWORD cluster = file->obj.sclust;
+    if(cluster == 0) return FR_NO_FILESYSTEM;
+
+    APK_chain_t chain = {0, 0};
+    FRESULT res = FSCH_walk(fs, cluster, APK_countRun, &chain);
+    if(res != FR_OK) return res;
+    if(chain.runs != 1) return FR_DENIED;
+
+    archive->pdrv = fs->pdrv;
+    archive->baseSector = fs->database + (cluster - 2) * fs->csize;
+    return FR_OK;
+}
+
+static FRESULT APK_loadIndex(APK_archive_t * archive, FIL * file){
+    APK_header_t header;
+    UINT read;
+
+    FRESULT res = f_read(file, &header, sizeof(APK_header_t), &read);
+    if(res != FR_OK) return res;
+    if(read != sizeof(APK_header_t) || header.magic != APK_MAGIC || header.version != APK_VERSION || header.entrySize != sizeof(APK_entry_t)) return FR_NO_FILESYSTEM;
+
+    uint64_t indexSize = (uint64_t) header.entryCount * sizeof(APK_entry_t);
+    if(sizeof(APK_header_t) + indexSize > f_size(file)) return FR_NO_FILESYSTEM;
+
+    archive->index = pvPortMalloc(indexSize ? indexSize : 1);
+    if(archive->index == NULL) return FR_NOT_ENOUGH_CORE;
+    archive->count = header.entryCount;
+
+    res = f_read(file, archive->index, indexSize, &read);
+    if(res != FR_OK) return res;
+    if(read != indexSize) return FR_NO_FILESYSTEM;
+
+    //lookups rely on the order, and the readLists on the offsets
+    for(uint32_t i = 0; i < archive->count; i++){
+        APK_entry_t * entry = &archive->index[i];
+        if(i > 0 && entry->hash <= archive->index[i - 1].hash) return FR_NO_FILESYSTEM;
+        if((uint64_t) entry->offset + entry->length > f_size(file)) return FR_NO_FILESYSTEM;
+    }
+
+    return FR_OK;
+}
+
+/* Loads the index of the archive at path, call it once after mounting. Returns FR_NO_FILESYSTEM if the file isn't a valid
+ * archive and FR_DENIED if it is fragmented, in which case it needs to be copied to a card with enough contiguous free
+ * space (a freshly formatted one) */
+FRESULT APK_open(APK_archive_t * archive, const char * path){
+    memset(archive, 0, sizeof(APK_archive_t));
+
+    FIL * file = pvPortMalloc(sizeof(FIL));
+    if(file == NULL) return FR_NOT_ENOUGH_CORE;
+
+    FRESULT res = f_open(file, path, FA_READ);
+    if(res == FR_OK){
+        res = APK_loadIndex(archive, file);
+        if(res == FR_OK) res = APK_locate(archive, file);
+        f_close(file);
+    }
+    vPortFree(file);
+
+    if(res != FR_OK) APK_close(archive);
+    return res;
+}
+
+void APK_close(APK_archive_t * archive){
+    vPortFree(archive->index);
+    archive->index = NULL;
+    archive->count = 0;
+}
+
+//returns the index entry of name, NULL if there is none
+const APK_entry_t * APK_find(const APK_archive_t * archive, const char * name){
+    uint32_t hash = APK_hash(name);
+    uint32_t low = 0, high = archive->count;
+
+    while(low < high){
+        uint32_t mid = low + (high - low) / 2;
+        if(archive->index[mid].hash == hash){
+            //hashes are unique, so if the check doesn't match either the name isn't in the archive
+            return (archive->index[mid].check == APK_check(name)) ? &archive->index[mid] : NULL;
+        }
+        if(archive->index[mid].hash < hash){
+            low = mid + 1;
+        }else{
+            high = mid;
+        }
+    }
+
+    return NULL;
+}
+
+/* Appends name to list, so several assets can be fetched with a single disk_readList(archive->pdrv, ...) call. Returns
+ * the length of the asset, 0 if it doesn't exist, is empty or there is no memory left, nothing is added then */
+uint32_t APK_addToList(const APK_archive_t * archive, const char * name, DLLObject * list){
+    const APK_entry_t * entry = APK_find(archive, name);
+    if(entry == NULL || entry->length == 0) return 0;
+
+    ff_readListData_t * item = pvPortMalloc(sizeof(ff_readListData_t));
+    if(item == NULL) return 0;
+    item->startSector = archive->baseSector + entry->offset / 512;
+    item->startByte = entry->offset % 512;
+    item->bytesToRead = entry->length;
+    DLL_add(item, list);
+
+    return entry->length;
+}
+
+/* reads up to buffSize bytes of name into buff. The full length of the asset is stored in length. disk_readList wakes
+ * the card first if it is in low power mode, so this works without any FatFs call before it */
+FRESULT APK_read(const APK_archive_t * archive, const char * name, BYTE * buff, uint32_t buffSize, uint32_t * length){
+    const APK_entry_t * entry = APK_find(archive, name);
+    if(entry == NULL) return FR_NO_FILE;
+    *length = entry->length;
+
+    uint32_t bytes = (entry->length < buffSize) ? entry->length : buffSize;
+    if(bytes == 0) return FR_OK;
+
+    DLLObject * list = DLL_create();
+    if(list == NULL) return FR_NOT_ENOUGH_CORE;
+    ff_readListData_t * item = pvPortMalloc(sizeof(ff_readListData_t));
+    if(item == NULL){
+        DLL_free(list);
+        return FR_NOT_ENOUGH_CORE;
+    }
+    item->startSector = archive->baseSector + entry->offset / 512;
+    item->startByte = entry->offset % 512;
+    item->bytesToRead = bytes;
+    DLL_add(item, list);
+
+    return (disk_readList(archive->pdrv, buff, list) == RES_OK) ? FR_OK : FR_DISK_ERR;
+}
+
+/* Reads every asset in names (up to APK_BENCH_BUFFER bytes of it) from the archive, and then all of them again as files
+ * in dir with f_open/f_read. Reports the average time from the name to the data for both in us. The two passes don't
+ * interleave, so the archive reads get no help from FatFs's window or the read-ahead of the file reads. dir needs to
+ * hold a copy of the directory the archive was packed from */
+FRESULT APK_benchmark(const APK_archive_t * archive, const char * dir, const char * const * names, uint32_t count, uint32_t * packUs, uint32_t * fatfsUs){
+    if(count == 0) return FR_INVALID_PARAMETER;
+
+    BYTE * buff = pvPortMalloc(APK_BENCH_BUFFER);
+    FIL * file = pvPortMalloc(sizeof(FIL));
+    char * path = pvPortMalloc(APK_PATH_LENGTH);
+    if(buff == NULL || file == NULL || path == NULL){
+        vPortFree(buff);
+        vPortFree(file);
+        vPortFree(path);
+        return FR_NOT_ENOUGH_CORE;
+    }
+
+    uint64_t packTime = 0, fatfsTime = 0;
+    uint32_t length;
+
+    //untimed, wakes the card if it is in low power mode so neither pass pays for that
+    FRESULT res = APK_read(archive, names[0], buff, APK_BENCH_BUFFER, &length);
+
+    for(uint32_t i = 0; i < count && res == FR_OK; i++){
+        uint32_t start = _CP0_GET_COUNT();
+        res = APK_read(archive, names[i], buff, APK_BENCH_BUFFER, &length);
+        packTime += _CP0_GET_COUNT() - start;
+    }
+
+    for(uint32_t i = 0; i < count && res == FR_OK; i++){
+        snprintf(path, APK_PATH_LENGTH, "%s/%s", dir, names[i]);
+        uint32_t start = _CP0_GET_COUNT();
+        res = f_open(file, path, FA_READ);
+        if(res == FR_OK){
+            UINT read;
+            res = f_read(file, buff, APK_BENCH_BUFFER, &read);
+            f_close(file);
+        }
+        fatfsTime += _CP0_GET_COUNT() - start;
+    }
+
+    *packUs = packTime / count / (configCPU_CLOCK_HZ / 2000000);
+    *fatfsUs = fatfsTime / count / (configCPU_CLOCK_HZ / 2000000);
+
+    vPortFree(path);
+    vPortFree(file);
+    vPortFree(buff);
+    return res;
+}
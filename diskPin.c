@@ -0,0 +1,267 @@
+#include <xc.h>
+#include <stdint.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "diskio.h"
+#include "ff.h"
+#include "diskioConfig.h"
+#include "diskPin.h"
+
+#if PIN_ENABLED
+
+/*
+ * Sector pinning
+ *
+ * disk_pin returns a pointer into a pool owned by the driver instead of copying into a buffer of the caller. Everyone
+ * pinning a range that is already in the pool gets a pointer to the same copy, so read-mostly tables and fonts only exist
+ * in ram once and never get memcpy'd around. Missing sectors are read with disk_readList (so with the dma read path),
+ * sectors some other entry already holds are copied from there.
+ *
+ * Entries stay in the pool after their last disk_unpin and get evicted, least recently pinned first, once room is needed.
+ * disk_write updates every copy of the sectors it writes, so pinned data always matches the card. It can therefore change
+ * while it is pinned if somebody writes to those sectors. Entries that can't match the card anymore (erased or the card
+ * was swapped) but are still pinned become stale: their holders keep the old data, but nobody else gets it and they are
+ * freed at their last disk_unpin.
+ */
+
+typedef struct{
+    uint32_t used;
+    uint32_t stale;         //doesn't match the card anymore, only kept until it is unpinned
+    BYTE pdrv;
+    DWORD sector;
+    UINT count;
+    uint32_t refs;
+    uint32_t slot;          //first pool sector holding the range
+    uint32_t lastUse;       //value of PIN_useCounter when it was last pinned
+} PIN_entry_t;
+
+static BYTE PIN_pool[PIN_POOL_SECTORS][512];
+static PIN_entry_t PIN_entries[PIN_MAX_ENTRIES];
+static PIN_stats_t PIN_stats;
+static uint32_t PIN_useCounter;
+static SemaphoreHandle_t PIN_mutex;     //guards everything above. Fills run with it held
+
+static void PIN_lock(){
+    if(PIN_mutex == NULL){
+        taskENTER_CRITICAL();
+        if(PIN_mutex == NULL) PIN_mutex = xSemaphoreCreateMutex();
+        taskEXIT_CRITICAL();
+    }
+    xSemaphoreTake(PIN_mutex, portMAX_DELAY);
+}
+
+static void PIN_unlock(){
+    xSemaphoreGive(PIN_mutex);
+}
+
+//returns an entry holding all of the range, NULL if there is none
+static PIN_entry_t * PIN_find(BYTE pdrv, DWORD sector, UINT count){
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        PIN_entry_t * entry = &PIN_entries[i];
+        if(entry->used && !entry->stale && entry->pdrv == pdrv && sector >= entry->sector && sector + count <= entry->sector + entry->count) return entry;
+    }
+    return NULL;
+}
+
+//drops the least recently used entry that isn't pinned. Returns 0 if everything is pinned
+static uint32_t PIN_evict(){
+    PIN_entry_t * oldest = NULL;
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        PIN_entry_t * entry = &PIN_entries[i];
+        if(entry->used && entry->refs == 0 && (oldest == NULL || entry->lastUse < oldest->lastUse)) oldest = entry;
+    }
+
+    if(oldest == NULL) return 0;
+    oldest->used = 0;
+    PIN_stats.evictions++;
+    return 1;
+}
+
+//first run of count pool sectors that no entry uses, -1 if there is none
+static int32_t PIN_findSlots(UINT count){
+    BYTE taken[PIN_POOL_SECTORS];
+    memset(taken, 0, sizeof(taken));
+
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        if(PIN_entries[i].used) memset(&taken[PIN_entries[i].slot], 1, PIN_entries[i].count);
+    }
+
+    UINT run = 0;
+    for(uint32_t i = 0; i < PIN_POOL_SECTORS; i++){
+        run = taken[i] ? 0 : run + 1;
+        if(run == count) return i + 1 - count;
+    }
+    return -1;
+}
+
+//gets an unused entry with room for count sectors, evicting others if needed. It only counts as used once filled
+static PIN_entry_t * PIN_allocate(UINT count){
+    PIN_entry_t * entry = NULL;
+
+    while(entry == NULL){
+        for(uint32_t i = 0; i < PIN_MAX_ENTRIES && entry == NULL; i++){
+            if(!PIN_entries[i].used) entry = &PIN_entries[i];
+        }
+        if(entry == NULL && !PIN_evict()) return NULL;
+    }
+
+    int32_t slot;
+    while((slot = PIN_findSlots(count)) < 0){
+        if(!PIN_evict()) return NULL;
+    }
+
+    entry->slot = slot;
+    return entry;
+}
+
+static DRESULT PIN_read(PIN_entry_t * entry, UINT first, UINT count){
+    DLLObject * list = DLL_create();
+    ff_readListData_t * item = pvPortMalloc(sizeof(ff_readListData_t));
+    item->startSector = entry->sector + first;
+    item->startByte = 0;
+    item->bytesToRead = count * 512;
+    DLL_add(item, list);
+
+    PIN_stats.sectorsRead += count;
+    return disk_readList(entry->pdrv, PIN_pool[entry->slot + first], list);
+}
+
+//copies what other entries already hold and reads the rest from the card, one list per missing run
+static DRESULT PIN_fill(PIN_entry_t * entry){
+    DRESULT res = RES_OK;
+    UINT missingStart = 0, missingCount = 0;
+
+    for(UINT i = 0; i <= entry->count && res == RES_OK; i++){
+        PIN_entry_t * source = NULL;
+        if(i < entry->count){
+            source = PIN_find(entry->pdrv, entry->sector + i, 1);
+            if(source == NULL){
+                if(missingCount++ == 0) missingStart = i;
+                continue;
+            }
+        }
+
+        if(missingCount){
+            res = PIN_read(entry, missingStart, missingCount);
+            missingCount = 0;
+        }
+
+        if(source){
+            memcpy(PIN_pool[entry->slot + i], PIN_pool[source->slot + entry->sector + i - source->sector], 512);
+            PIN_stats.sectorsCopied++;
+        }
+    }
+
+    return res;
+}
+
+/* Returns a read-only pointer to count sectors starting at sector of drive pdrv, NULL if the pool has no room for them
+ * or the read failed. Give it back with disk_unpin once done */
+const BYTE * disk_pin(BYTE pdrv, DWORD sector, UINT count){
+    if(count == 0 || count > PIN_POOL_SECTORS) return NULL;
+
+    PIN_lock();
+
+    const BYTE * data = NULL;
+    PIN_entry_t * entry = PIN_find(pdrv, sector, count);
+    if(entry != NULL){
+        data = PIN_pool[entry->slot + sector - entry->sector];
+        PIN_stats.hits++;
+    }else if((entry = PIN_allocate(count)) != NULL){
+        entry->pdrv = pdrv;
+        entry->sector = sector;
+        entry->count = count;
+        entry->refs = 0;
+        entry->stale = 0;
+        if(PIN_fill(entry) == RES_OK){
+            entry->used = 1;
+            data = PIN_pool[entry->slot];
+        }
+    }
+
+    if(data != NULL){
+        entry->refs++;
+        entry->lastUse = ++PIN_useCounter;
+        PIN_stats.pins++;
+    }else{
+        PIN_stats.failed++;
+    }
+
+    PIN_unlock();
+    return data;
+}
+
+//releases a pointer returned by disk_pin
+void disk_unpin(const BYTE * data){
+    if(data < PIN_pool[0] || data >= PIN_pool[PIN_POOL_SECTORS]) return;
+    uint32_t slot = (data - PIN_pool[0]) / 512;
+
+    PIN_lock();
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        PIN_entry_t * entry = &PIN_entries[i];
+        if(entry->used && slot >= entry->slot && slot < entry->slot + entry->count){
+            if(entry->refs) entry->refs--;
+            if(entry->refs == 0 && entry->stale) entry->used = 0;
+            break;
+        }
+    }
+    PIN_unlock();
+}
+
+void disk_getPinStats(PIN_stats_t * stats){
+    PIN_lock();
+    memcpy(stats, &PIN_stats, sizeof(PIN_stats_t));
+    PIN_unlock();
+}
+
+//called by disk_write, keeps the copies in the pool identical to the card
+void PIN_sectorWritten(BYTE pdrv, DWORD sector, const BYTE * buff, UINT count){
+    if(PIN_mutex == NULL) return;   //nothing was pinned yet
+
+    PIN_lock();
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        PIN_entry_t * entry = &PIN_entries[i];
+        if(!entry->used || entry->stale || entry->pdrv != pdrv) continue;
+
+        DWORD first = (sector > entry->sector) ? sector : entry->sector;
+        DWORD end = (sector + count < entry->sector + entry->count) ? sector + count : entry->sector + entry->count;
+        if(first < end) memcpy(PIN_pool[entry->slot + first - entry->sector], &buff[(first - sector) * 512], (end - first) * 512);
+    }
+    PIN_unlock();
+}
+
+//drops entry if nobody has it pinned, otherwise it goes stale until the last disk_unpin
+static void PIN_invalidate(PIN_entry_t * entry){
+    if(entry->refs == 0){
+        entry->used = 0;
+    }else{
+        entry->stale = 1;
+    }
+}
+
+//called by disk_ioctl for CTRL_TRIM, forgets every entry holding one of the erased sectors first..last
+void PIN_sectorsErased(BYTE pdrv, DWORD first, DWORD last){
+    if(PIN_mutex == NULL) return;
+
+    PIN_lock();
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        PIN_entry_t * entry = &PIN_entries[i];
+        if(entry->used && entry->pdrv == pdrv && first < entry->sector + entry->count && last >= entry->sector) PIN_invalidate(entry);
+    }
+    PIN_unlock();
+}
+
+//forgets the cached sectors of pdrv, for when the card was swapped
+void PIN_dropDrive(BYTE pdrv){
+    if(PIN_mutex == NULL) return;
+
+    PIN_lock();
+    for(uint32_t i = 0; i < PIN_MAX_ENTRIES; i++){
+        if(PIN_entries[i].used && PIN_entries[i].pdrv == pdrv) PIN_invalidate(&PIN_entries[i]);
+    }
+    PIN_unlock();
+}
+
+#endif
@@ -0,0 +1,276 @@
+#include <xc.h>
+#include <stdint.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "diskio.h"
+#include "ff.h"
+#include "diskioConfig.h"
+#include "diskStripe.h"
+
+#if SD_STRIPE_ENABLED
+
+/*
+ * RAID-0 over SD_CARD_COUNT cards
+ *
+ * Sector s of the striped drive is in stripe s / SD_STRIPE_SECTORS, and stripe n is stored on card n % SD_CARD_COUNT. The
+ * part of a transfer that belongs to one card is always consecutive on that card, it is just spread over the buffer in
+ * pieces of SD_STRIPE_SECTORS. The cards are handled one after the other in the calling task. Writes only exist as pio
+ * and the dma reads always fill the buffer front to back, so there is nothing that could overlap the cards. Striping
+ * adds up the capacity of the cards, not their speed
+ */
+
+typedef enum {STRIPE_OP_READ, STRIPE_OP_WRITE} STRIPE_op_t;
+
+typedef struct{
+    STRIPE_op_t op;
+    BYTE * buff;
+    ff_readListData_t ** entries;   //byte ranges of the striped drive, transferred into buff one after the other
+    uint32_t count;
+} STRIPE_job_t;
+
+//returns the card holding sector of the striped drive and the sector on that card
+static BYTE STRIPE_map(DWORD sector, DWORD * cardSector){
+    DWORD stripe = sector / SD_STRIPE_SECTORS;
+    *cardSector = (stripe / SD_CARD_COUNT) * SD_STRIPE_SECTORS + sector % SD_STRIPE_SECTORS;
+    return stripe % SD_CARD_COUNT;
+}
+
+//reads are always done with disk_readList, that is the path using dma
+static DRESULT STRIPE_readChunk(BYTE card, BYTE * buff, DWORD sector, UINT offset, UINT length){
+    DLLObject * list = DLL_create();
+    ff_readListData_t * entry = pvPortMalloc(sizeof(ff_readListData_t));
+    entry->startSector = sector;
+    entry->startByte = offset;
+    entry->bytesToRead = length;
+    DLL_add(entry, list);
+
+    return disk_readList(card, buff, list);
+}
+
+//transfers everything of the job that is stored on card
+static DRESULT STRIPE_runPart(STRIPE_job_t * job, BYTE card){
+    DRESULT res = RES_OK;
+    BYTE * buff = job->buff;
+
+    for(uint32_t i = 0; i < job->count && res == RES_OK; i++){
+        DWORD sector = job->entries[i]->startSector + job->entries[i]->startByte / 512;
+        UINT offset = job->entries[i]->startByte % 512;
+        UINT bytesLeft = job->entries[i]->bytesToRead;
+
+        while(bytesLeft && res == RES_OK){
+            //up to the end of the current stripe
+            UINT length = (SD_STRIPE_SECTORS - sector % SD_STRIPE_SECTORS) * 512 - offset;
+            if(length > bytesLeft) length = bytesLeft;
+
+            DWORD cardSector;
+            if(STRIPE_map(sector, &cardSector) == card){
+                switch(job->op){
+                    case STRIPE_OP_READ:
+                        res = STRIPE_readChunk(card, buff, cardSector, offset, length);
+                        break;
+#if _READONLY == 0
+                    case STRIPE_OP_WRITE:
+                        res = disk_write(card, buff, cardSector, length / 512);
+                        break;
+#endif
+                    default:
+                        res = RES_PARERR;
+                }
+            }
+
+            buff += length;
+            bytesLeft -= length;
+            sector += (offset + length) / 512;
+            offset = (offset + length) % 512;
+        }
+    }
+
+    return res;
+}
+
+//card by card, so each card gets its whole share with a single lock of its bus
+static DRESULT STRIPE_run(STRIPE_op_t op, BYTE * buff, ff_readListData_t ** entries, uint32_t count){
+    STRIPE_job_t job = {.op = op, .buff = buff, .entries = entries, .count = count};
+    DRESULT res = RES_OK;
+
+    for(BYTE card = 0; card < SD_CARD_COUNT && res == RES_OK; card++){
+        res = STRIPE_runPart(&job, card);
+    }
+
+    return res;
+}
+
+DSTATUS STRIPE_initialize(){
+    DSTATUS stat = 0;
+    for(BYTE card = 0; card < SD_CARD_COUNT; card++) stat |= disk_initialize(card);
+    return stat;
+}
+
+DSTATUS STRIPE_status(){
+    DSTATUS stat = 0;
+    for(BYTE card = 0; card < SD_CARD_COUNT; card++) stat |= disk_status(card);
+    return stat;
+}
+
+DRESULT STRIPE_read(BYTE * buff, DWORD sector, UINT count){
+    ff_readListData_t range = {.startSector = sector, .startByte = 0, .bytesToRead = count * 512};
+    ff_readListData_t * entries[1] = {&range};
+    return STRIPE_run(STRIPE_OP_READ, buff, entries, 1);
+}
+
+DRESULT STRIPE_write(const BYTE * buff, DWORD sector, UINT count){
+    ff_readListData_t range = {.startSector = sector, .startByte = 0, .bytesToRead = count * 512};
+    ff_readListData_t * entries[1] = {&range};
+    return STRIPE_run(STRIPE_OP_WRITE, (BYTE *) buff, entries, 1);
+}
+
+/* The cards are read one after the other and not in the order of the data, so callback only gets the blocks once 
+ * everything arrived */
+DRESULT STRIPE_readList(BYTE * buff, DLLObject * list, SD_blockCallback_t callback, void * context){
+    uint32_t count = DLL_length(list);
+    ff_readListData_t ** entries = pvPortMalloc(sizeof(ff_readListData_t *) * (count ? count : 1));
+    DRESULT res = RES_ERROR;
+
+    if(entries != NULL){
+        for(uint32_t i = 0; i < count; i++) entries[i] = DLL_pop(list);
+        res = STRIPE_run(STRIPE_OP_READ, buff, entries, count);
+
+        BYTE * data = buff;
+        for(uint32_t i = 0; callback && res == RES_OK && i < count; i++){
+            UINT offset = entries[i]->startByte % 512;
+            UINT bytesLeft = entries[i]->bytesToRead;
+
+            while(bytesLeft){
+                UINT length = 512 - offset;
+                if(length > bytesLeft) length = bytesLeft;
+                callback(context, data, length);
+                data += length;
+                bytesLeft -= length;
+                offset = 0;
+            }
+        }
+
+        for(uint32_t i = 0; i < count; i++) vPortFree(entries[i]);
+        vPortFree(entries);
+    }
+
+    //empty list if anything remains
+    ff_readListData_t * currObj;
+    while((currObj = DLL_pop(list))) vPortFree(currObj);
+    DLL_free(list);
+
+    return res;
+}
+
+DRESULT STRIPE_ioctl(BYTE ctrl, void * buff){
+    DRESULT res = RES_OK;
+
+    switch(ctrl){
+        case CTRL_SYNC:
+            for(BYTE card = 0; card < SD_CARD_COUNT; card++){
+                if(disk_ioctl(card, CTRL_SYNC, NULL) != RES_OK) res = RES_ERROR;
+            }
+            return res;
+
+        case GET_SECTOR_COUNT: {
+            //the smallest card limits the size, and only whole stripes can be used
+            DWORD smallest = 0xffffffff;
+            for(BYTE card = 0; card < SD_CARD_COUNT; card++){
+                DWORD sectors;
+                if(disk_ioctl(card, GET_SECTOR_COUNT, &sectors) != RES_OK) return RES_ERROR;
+                if(sectors < smallest) smallest = sectors;
+            }
+            *(DWORD *) buff = (smallest / SD_STRIPE_SECTORS) * SD_STRIPE_SECTORS * SD_CARD_COUNT;
+            return RES_OK;
+        }
+
+        case GET_SECTOR_SIZE:
+            *(WORD *) buff = 512;
+            return RES_OK;
+
+        case GET_BLOCK_SIZE: {
+            //an AU on every card
+            DWORD au;
+            if(disk_ioctl(0, GET_BLOCK_SIZE, &au) != RES_OK) return RES_ERROR;
+            if(au < SD_STRIPE_SECTORS) au = SD_STRIPE_SECTORS;
+            *(DWORD *) buff = au * SD_CARD_COUNT;
+            return RES_OK;
+        }
+
+        case CTRL_TRIM: {
+            //each card's share of the range is consecutive on the card, find its first and last sector
+            DWORD start = ((DWORD *) buff)[0], end = ((DWORD *) buff)[1];
+            for(BYTE card = 0; card < SD_CARD_COUNT; card++){
+                DWORD range[2];
+                DWORD first, last;
+
+                DWORD sector = start;
+                while(sector <= end && STRIPE_map(sector, &first) != card) sector = (sector / SD_STRIPE_SECTORS + 1) * SD_STRIPE_SECTORS;
+                if(sector > end) continue;   //range too short to reach this card
+
+                sector = end;
+                while(STRIPE_map(sector, &last) != card) sector = (sector / SD_STRIPE_SECTORS) * SD_STRIPE_SECTORS - 1;
+
+                range[0] = first;
+                range[1] = last;
+                if(disk_ioctl(card, CTRL_TRIM, range) != RES_OK) res = RES_ERROR;
+            }
+            return res;
+        }
+
+        case MMC_GET_ERASED: {
+            //erased sectors of the striped drive only read as 0x00 if they do on every card
+            BYTE erased = 0;
+            for(BYTE card = 0; card < SD_CARD_COUNT; card++){
+                BYTE value;
+                if(disk_ioctl(card, MMC_GET_ERASED, &value) != RES_OK) return RES_ERROR;
+                erased |= value;
+            }
+            *(BYTE *) buff = erased;
+            return RES_OK;
+        }
+
+        default:
+            //card specific requests need to go to the cards themselves
+            return RES_PARERR;
+    }
+}
+
+/* Moves bytes starting at sector of drive pdrv through buff in pieces of buffSize and returns the throughput in kB/s, or
+ * 0 if a transfer failed. Reads use disk_readList, writes disk_write and overwrite whatever is stored there! Run it on a
+ * single card and on SD_STRIPE_DRIVE to compare */
+uint32_t STRIPE_benchmark(BYTE pdrv, BYTE * buff, UINT buffSize, DWORD sector, DWORD bytes, uint32_t write){
+    buffSize &= ~511;
+    if(buffSize == 0) return 0;
+
+    TickType_t start = xTaskGetTickCount();
+
+    for(DWORD done = 0; done < bytes; done += buffSize){
+        DRESULT res;
+        if(buffSize > bytes - done) buffSize = (bytes - done + 511) & ~511;
+
+        if(write){
+#if _READONLY == 0
+            res = disk_write(pdrv, buff, sector + done / 512, buffSize / 512);
+#else
+            res = RES_WRPRT;
+#endif
+        }else{
+            DLLObject * list = DLL_create();
+            ff_readListData_t * entry = pvPortMalloc(sizeof(ff_readListData_t));
+            entry->startSector = sector + done / 512;
+            entry->startByte = 0;
+            entry->bytesToRead = buffSize;
+            DLL_add(entry, list);
+            res = disk_readList(pdrv, buff, list);
+        }
+
+        if(res != RES_OK) return 0;
+    }
+
+    TickType_t ticks = xTaskGetTickCount() - start;
+    if(ticks == 0) ticks = 1;
+    return ((uint64_t) bytes * configTICK_RATE_HZ) / (1024 * (uint64_t) ticks);
+}
+
+#endif
@@ -0,0 +1,146 @@
+#include <xc.h>
+#include <stdint.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "diskio.h"
+#include "diskioConfig.h"
+#include "diskTrace.h"
+#include "ff.h"
+#include "TTerm.h"
+
+#if DTRACE_ENABLED
+
+//core timer runs at half the cpu clock
+#define DTRACE_TIMER_FREQ (configCPU_CLOCK_HZ / 2)
+
+static DTRACE_record_t DTRACE_ring[DTRACE_RING_SIZE];
+static uint32_t DTRACE_writeIndex = 0;
+static uint32_t DTRACE_count = 0;
+static uint32_t DTRACE_dropped = 0;
+static volatile uint32_t DTRACE_enabled = 1;
+
+uint32_t DTRACE_getTime(){
+    return _CP0_GET_COUNT();
+}
+
+void DTRACE_record(DTRACE_op_t op, uint32_t sector, uint32_t length, uint32_t offset, uint32_t result, uint32_t startTime){
+    if(!DTRACE_enabled) return;
+
+    uint32_t now = _CP0_GET_COUNT();
+
+    taskENTER_CRITICAL();
+    DTRACE_record_t * rec = &DTRACE_ring[DTRACE_writeIndex];
+    rec->timestamp = startTime;
+    rec->latency = now - startTime;
+    rec->sector = sector;
+    rec->length = length;
+    rec->offset = offset;
+    rec->op = op;
+    rec->result = result;
+
+    if(++DTRACE_writeIndex >= DTRACE_RING_SIZE) DTRACE_writeIndex = 0;
+
+    //ring full? Then we just overwrote the oldest record
+    if(DTRACE_count < DTRACE_RING_SIZE) DTRACE_count++; else DTRACE_dropped++;
+    taskEXIT_CRITICAL();
+}
+
+void DTRACE_setEnabled(uint32_t enabled){
+    DTRACE_enabled = enabled;
+}
+
+void DTRACE_clear(){
+    taskENTER_CRITICAL();
+    DTRACE_count = 0;
+    DTRACE_dropped = 0;
+    taskEXIT_CRITICAL();
+}
+
+//copies the oldest records into dst and removes them from the ring. Returns the number of records copied
+uint32_t DTRACE_read(DTRACE_record_t * dst, uint32_t maxCount){
+    uint32_t copied = 0;
+
+    taskENTER_CRITICAL();
+    while(DTRACE_count && copied < maxCount){
+        uint32_t readIndex = (DTRACE_writeIndex + DTRACE_RING_SIZE - DTRACE_count) % DTRACE_RING_SIZE;
+        dst[copied++] = DTRACE_ring[readIndex];
+        DTRACE_count--;
+    }
+    taskEXIT_CRITICAL();
+
+    return copied;
+}
+
+static void DTRACE_fillHeader(DTRACE_fileHeader_t * header){
+    header->magic = DTRACE_MAGIC;
+    header->version = DTRACE_VERSION;
+    header->recordSize = sizeof(DTRACE_record_t);
+    header->timerFreq = DTRACE_TIMER_FREQ;
+    header->recordCount = DTRACE_count;
+    header->dropped = DTRACE_dropped;
+}
+
+FRESULT DTRACE_dumpToFile(const char * path){
+    //the file writes would end up in the trace themselves, so stop tracing until we are done
+    uint32_t wasEnabled = DTRACE_enabled;
+    DTRACE_enabled = 0;
+
+    FIL * fp = pvPortMalloc(sizeof(FIL));
+    FRESULT res = f_open(fp, path, FA_WRITE | FA_CREATE_ALWAYS);
+
+    if(res == FR_OK){
+        DTRACE_fileHeader_t header;
+        DTRACE_fillHeader(&header);
+
+        UINT written;
+        res = f_write(fp, &header, sizeof(header), &written);
+
+        DTRACE_record_t chunk[16];
+        uint32_t count;
+        while(res == FR_OK && (count = DTRACE_read(chunk, 16))){
+            res = f_write(fp, chunk, count * sizeof(DTRACE_record_t), &written);
+        }
+
+        FRESULT closeRes = f_close(fp);
+        if(res == FR_OK) res = closeRes;
+
+        DTRACE_dropped = 0;
+    }
+
+    vPortFree(fp);
+    DTRACE_enabled = wasEnabled;
+
+    return res;
+}
+
+static void DTRACE_printHex(TERMINAL_HANDLE * handle, char prefix, void * data, uint32_t length){
+    char line[2 + sizeof(DTRACE_fileHeader_t) * 2 + 3];
+    const char * hex = "0123456789abcdef";
+    uint8_t * d = (uint8_t *) data;
+
+    uint32_t pos = 0;
+    line[pos++] = prefix;
+    line[pos++] = ':';
+    for(uint32_t i = 0; i < length; i++){
+        line[pos++] = hex[d[i] >> 4];
+        line[pos++] = hex[d[i] & 0xf];
+    }
+    line[pos] = 0;
+
+    TERM_printDebug(handle, "%s\r\n", line);
+}
+
+//prints the ring as hex lines ("H:" header followed by one "R:" line per record). diskTraceReplay -x reads this format back
+void DTRACE_dumpToTerminal(TERMINAL_HANDLE * handle){
+    DTRACE_fileHeader_t header;
+    DTRACE_fillHeader(&header);
+    DTRACE_printHex(handle, 'H', &header, sizeof(header));
+
+    DTRACE_record_t rec;
+    while(DTRACE_read(&rec, 1)) DTRACE_printHex(handle, 'R', &rec, sizeof(rec));
+
+    DTRACE_dropped = 0;
+}
+
+#endif
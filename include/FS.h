@@ -1,9 +1,38 @@
 #include <xc.h>
 #include <stdint.h>
 #include "SPI.h"
+#include "FreeRTOS.h"
+
+#ifndef FS_DEFER_QUEUE_LENGTH
+#define FS_DEFER_QUEUE_LENGTH 8
+#endif
+#ifndef FS_DEFER_STACK_SIZE
+#define FS_DEFER_STACK_SIZE (configMINIMAL_STACK_SIZE + 400)
+#endif
+
+//indices into FS_powerStats_t.timeInState
+#define FS_POWER_NOT_PRESENT    0
+#define FS_POWER_LOW_POWER      1
+#define FS_POWER_READY          2
+#define FS_POWER_ERROR          3
+#define FS_POWER_STATE_COUNT    4
+
+typedef struct{
+    TickType_t timeInState[FS_POWER_STATE_COUNT];   //ticks spent in each power state since boot
+    uint32_t wakes;                     //times the card was powered up and initialized
+    uint32_t wakesPerHour;              //wakes averaged over the whole runtime
+    uint32_t deferredJobsRun;
+    uint32_t deferredDeadlineWakes;     //times deferred jobs had to wake the card themselves
+    uint32_t deferredJobsDropped;       //jobs that reached their deadline without a working card
+} FS_powerStats_t;
+
+typedef void (* FS_deferredJob_t)(void * context);
 
 void FS_sdCardIOEvtHandler();
 void FS_init(SPIHandle_t * spiHandle);
 uint8_t FS_dirUp(char * path);
 char * FS_newCWD(char * oldPath, char * newPath);
-uint32_t FS_clearPowerTimeout();
\ No newline at end of file
+uint32_t FS_clearPowerTimeout();
+uint32_t FS_renewPowerTimeout();
+uint32_t FS_defer(FS_deferredJob_t job, void * context, TickType_t maxDeferral);
+void FS_getPowerStats(FS_powerStats_t * stats);
@@ -0,0 +1,12 @@
+#include <stdint.h>
+#include "ff.h"
+#include "diskio.h"
+
+//gets every run of consecutive clusters of a chain. Return 0 to stop the walk
+typedef uint32_t (* FSCH_runCallback_t)(void * context, DWORD firstCluster, DWORD clusterCount);
+
+uint32_t FSCH_lock(FATFS * fs);
+void FSCH_unlock(FATFS * fs);
+FRESULT FSCH_walk(FATFS * fs, DWORD startCluster, FSCH_runCallback_t callback, void * context);
+DRESULT FSCH_readSectors(FATFS * fs, BYTE * buff, DWORD sector, UINT count);
+void FSCH_patchFromWindow(FATFS * fs, BYTE * buff, DWORD sector, UINT count);
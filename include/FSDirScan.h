@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include "ff.h"
+
+#ifndef FSDS_BUFFER_SECTORS
+#define FSDS_BUFFER_SECTORS 16      //directory sectors fetched per disk_readList call
+#endif
+
+typedef struct{
+    char name[FF_MAX_LFN + 1];      //long name if there is one (converted to the oem code page), short name otherwise
+    char shortName[13];
+    DWORD size;
+    WORD date;                      //fat date and time of the last modification
+    WORD time;
+    BYTE attributes;                //AM_x
+    DWORD startCluster;
+} FSDS_entry_t;
+
+typedef struct{
+    const char * prefix;            //only names starting with this (case insensitive), NULL for all
+    DWORD minTimestamp;             //only entries modified inside this range of (date << 16) | time. 0 for no limit
+    DWORD maxTimestamp;
+    BYTE excludeAttributes;         //skip entries with any of these attributes, f.e. AM_DIR to only get files
+} FSDS_filter_t;
+
+//gets every entry that passed the filter. Return 0 to stop the scan
+typedef uint32_t (* FSDS_callback_t)(void * context, const FSDS_entry_t * entry);
+
+#define FSDS_TIMESTAMP(entry) (((DWORD) (entry)->date << 16) | (entry)->time)
+
+FRESULT FSDS_scan(const char * path, const FSDS_filter_t * filter, FSDS_callback_t callback, void * context, uint32_t * entryCount);
+FRESULT FSDS_findNewest(const char * path, const FSDS_filter_t * filter, FSDS_entry_t * newest);
+FRESULT FSDS_benchmark(const char * path, uint32_t * scanRate, uint32_t * readdirRate);
@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include "FreeRTOS.h"
+#include "ff.h"
+#include "diskio.h"
+
+#ifndef FSFMT_CLUSTER_SECTORS
+#define FSFMT_CLUSTER_SECTORS 64        //32kB as the sd spec recommends for SDHC, halved on cards too small for FAT32 with it
+#endif
+
+#ifndef FSFMT_DEFAULT_ALIGNMENT
+#define FSFMT_DEFAULT_ALIGNMENT 8192    //4MB boundary unit of SDHC cards, used if the card reports a smaller or no AU
+#endif
+
+#ifndef FSFMT_ERASE_SECTORS
+#define FSFMT_ERASE_SECTORS 0x100000    //sectors per CTRL_TRIM call, the driver splits them further to fit its erase timeout
+#endif
+
+#ifndef FSFMT_BUFFER_SECTORS
+#define FSFMT_BUFFER_SECTORS 8          //size of the buffer the FATs get zeroed with if erasing doesn't do that
+#endif
+
+#ifndef FSFMT_BENCH_SYNC_CHUNKS
+#define FSFMT_BENCH_SYNC_CHUNKS 16      //the benchmark calls f_sync after this many chunks, like a logger would
+#endif
+
+typedef struct{
+    DWORD sectorCount;          //of the whole card
+    DWORD auSize;               //reported by the card, 0 if unknown
+    DWORD alignment;            //partition and data area start on multiples of this
+    DWORD partitionStart;
+    DWORD partitionSize;
+    DWORD reservedSectors;
+    DWORD fatSize;              //sectors per FAT
+    DWORD dataStart;            //first sector of cluster 2
+    DWORD clusterSize;          //sectors
+    DWORD clusterCount;
+    uint32_t erased;            //the card was bulk erased with CTRL_TRIM
+    uint32_t fatsZeroed;        //the FATs had to be written with zeros since erasing didn't leave them zero
+    TickType_t duration;
+} FSFMT_layout_t;
+
+FRESULT FSFMT_format(BYTE pdrv, const char * label, FSFMT_layout_t * layout);
+uint32_t FSFMT_benchmark(const char * path, UINT chunkSize, DWORD bytes, uint32_t * worstChunkUs);
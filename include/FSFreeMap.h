@@ -0,0 +1,9 @@
+#include <stdint.h>
+#include "ff.h"
+
+void FSFM_start(FATFS * fs);
+void FSFM_stop();
+void FSFM_sectorWritten(BYTE pdrv, DWORD sector, const BYTE * buff, UINT count);
+uint32_t FSFM_getFree(DWORD * clusters);
+uint32_t FSFM_findExtent(DWORD clusters, DWORD * startCluster);
+uint32_t FSFM_setAllocationHint(DWORD clusters);
@@ -0,0 +1,83 @@
+/*
+ * Read-only archive of many small assets, served directly with disk_readList
+ *
+ * An archive is one file: an APK_header_t, the index (APK_entry_t sorted by the hash of the name) and then the data of
+ * every asset. It is built on a pc with tools/assetPacker.c. The index gets loaded by APK_open once, after that finding
+ * an asset and building the readList for it needs no metadata I/O at all.
+ *
+ * This header is also included by the host tools, so it must not pull in anything pic32 or FreeRTOS specific
+ */
+
+#ifndef ASSETPACK_H
+#define ASSETPACK_H
+
+#include <stdint.h>
+
+#define APK_MAGIC       0x4B415041  //"APAK"
+#define APK_VERSION     2
+
+//everything is little endian
+typedef struct __attribute__((packed)){
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entrySize;     //sizeof(APK_entry_t)
+    uint32_t entryCount;    //index entries following the header
+} APK_header_t;
+
+typedef struct __attribute__((packed)){
+    uint32_t hash;          //APK_hash of the name, the index is sorted by this and no two entries share one
+    uint32_t check;         //APK_check of the name, so names that aren't in the archive don't match by hash alone
+    uint32_t offset;        //byte offset of the data from the start of the archive
+    uint32_t length;        //bytes
+} APK_entry_t;
+
+//32 bit FNV-1a of the name of an asset, its path relative to the packed directory with '/' as separator
+static inline uint32_t APK_hash(const char * name){
+    uint32_t hash = 2166136261u;
+    while(*name){
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//Jenkins one-at-a-time hash of the name, independent of APK_hash
+static inline uint32_t APK_check(const char * name){
+    uint32_t hash = 0;
+    while(*name){
+        hash += (uint8_t) *name++;
+        hash += hash << 10;
+        hash ^= hash >> 6;
+    }
+    hash += hash << 3;
+    hash ^= hash >> 11;
+    hash += hash << 15;
+    return hash;
+}
+
+#ifndef APK_HOST_TOOL
+
+#include "ff.h"
+#include "diskio.h"
+
+#ifndef APK_BENCH_BUFFER
+#define APK_BENCH_BUFFER 4096       //bytes APK_benchmark reads of every asset at most
+#endif
+
+typedef struct{
+    BYTE pdrv;
+    DWORD baseSector;       //sector holding the first byte of the archive
+    uint32_t count;
+    APK_entry_t * index;
+} APK_archive_t;
+
+FRESULT APK_open(APK_archive_t * archive, const char * path);
+void APK_close(APK_archive_t * archive);
+const APK_entry_t * APK_find(const APK_archive_t * archive, const char * name);
+uint32_t APK_addToList(const APK_archive_t * archive, const char * name, DLLObject * list);
+FRESULT APK_read(const APK_archive_t * archive, const char * name, BYTE * buff, uint32_t buffSize, uint32_t * length);
+FRESULT APK_benchmark(const APK_archive_t * archive, const char * dir, const char * const * names, uint32_t count, uint32_t * packUs, uint32_t * fatfsUs);
+
+#endif
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Sector pinning, read-only access to sectors kept in a driver owned buffer pool
+ *
+ * The settings below can be overridden in diskioConfig.h, which needs to be included before this header
+ */
+
+#ifndef DISKPIN_H
+#define DISKPIN_H
+
+#include <stdint.h>
+#include "diskio.h"
+
+//set to 0 to leave out the pool and its ram
+#ifndef PIN_ENABLED
+#define PIN_ENABLED 1
+#endif
+
+//sectors in the pool, shared by all drives. A single pin can't be larger than this
+#ifndef PIN_POOL_SECTORS
+#define PIN_POOL_SECTORS 16
+#endif
+
+//ranges the pool keeps track of at once, pinned or cached for the next disk_pin
+#ifndef PIN_MAX_ENTRIES
+#define PIN_MAX_ENTRIES 8
+#endif
+
+typedef struct{
+    uint32_t pins;              //disk_pin calls that succeeded
+    uint32_t hits;              //...of those served without touching the card
+    uint32_t sectorsRead;       //sectors read from the card to fill the pool
+    uint32_t sectorsCopied;     //sectors copied over from other entries instead
+    uint32_t evictions;         //unpinned entries dropped to make room
+    uint32_t failed;            //disk_pin calls that found no room or failed to read
+} PIN_stats_t;
+
+#if PIN_ENABLED
+
+const BYTE * disk_pin(BYTE pdrv, DWORD sector, UINT count);
+void disk_unpin(const BYTE * data);
+void disk_getPinStats(PIN_stats_t * stats);
+void PIN_sectorWritten(BYTE pdrv, DWORD sector, const BYTE * buff, UINT count);
+void PIN_sectorsErased(BYTE pdrv, DWORD first, DWORD last);
+void PIN_dropDrive(BYTE pdrv);
+
+#else
+
+#define PIN_sectorWritten(pdrv, sector, buff, count)
+#define PIN_sectorsErased(pdrv, first, last)
+#define PIN_dropDrive(pdrv)
+
+#endif
+
+#endif
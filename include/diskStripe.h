@@ -0,0 +1,48 @@
+/*
+ * RAID-0 striping over several sd cards, each on its own spi bus
+ *
+ * All cards registered with disk_addCard are exposed together as drive SD_STRIPE_DRIVE. The settings below can be
+ * overridden in diskioConfig.h, which needs to be included before this header
+ */
+
+#ifndef DISKSTRIPE_H
+#define DISKSTRIPE_H
+
+#include <stdint.h>
+#include "diskio.h"
+#include "ff.h"
+
+//number of cards handled by the driver, drive n is the card registered with disk_addCard(n, ...)
+#ifndef SD_CARD_COUNT
+#define SD_CARD_COUNT 1
+#endif
+
+//set to 1 to compile in the striped drive
+#ifndef SD_STRIPE_ENABLED
+#define SD_STRIPE_ENABLED 0
+#endif
+
+//sectors that go to one card before moving on to the next. Should divide the AU size of the cards
+#ifndef SD_STRIPE_SECTORS
+#define SD_STRIPE_SECTORS 64
+#endif
+
+#define SD_STRIPE_DRIVE SD_CARD_COUNT
+
+#if SD_STRIPE_ENABLED
+
+#if SD_CARD_COUNT < 2
+#error "SD_STRIPE_ENABLED needs SD_CARD_COUNT to be at least 2"
+#endif
+
+DSTATUS STRIPE_initialize();
+DSTATUS STRIPE_status();
+DRESULT STRIPE_read(BYTE * buff, DWORD sector, UINT count);
+DRESULT STRIPE_write(const BYTE * buff, DWORD sector, UINT count);
+DRESULT STRIPE_readList(BYTE * buff, DLLObject * list, SD_blockCallback_t callback, void * context);
+DRESULT STRIPE_ioctl(BYTE ctrl, void * buff);
+uint32_t STRIPE_benchmark(BYTE pdrv, BYTE * buff, UINT buffSize, DWORD sector, DWORD bytes, uint32_t write);
+
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Binary trace of the disk_* calls going into the sd driver
+ *
+ * Every traced call produces one fixed size record that is stored in a ram ring buffer. The buffer can be dumped into a file
+ * or over the terminal and replayed on a pc with tools/diskTraceReplay.c
+ *
+ * This header is also included by the host tools, so it must not pull in anything pic32 or FreeRTOS specific
+ */
+
+#ifndef DISKTRACE_H
+#define DISKTRACE_H
+
+#include <stdint.h>
+
+//set to 1 in diskioConfig.h to compile the trace layer into the driver
+#ifndef DTRACE_ENABLED
+#define DTRACE_ENABLED 0
+#endif
+
+//number of records kept in ram, the oldest ones get overwritten once it is full
+#ifndef DTRACE_RING_SIZE
+#define DTRACE_RING_SIZE 256
+#endif
+
+#define DTRACE_MAGIC    0x45435254  //"TRCE"
+#define DTRACE_VERSION  1
+
+typedef enum {DTRACE_OP_READ = 0, DTRACE_OP_WRITE, DTRACE_OP_READLIST, DTRACE_OP_IOCTL} DTRACE_op_t;
+
+//one record per disk_read/disk_write/disk_ioctl call and per disk_readList entry. Little endian, stored and dumped as is
+typedef struct __attribute__((packed)){
+    uint32_t timestamp;     //core timer count at the start of the operation
+    uint32_t latency;       //core timer ticks until the operation returned
+    uint32_t sector;        //first sector (not byte address!) accessed. 0 for ioctls
+    uint32_t length;        //sector count for read/write, byte count for readList entries, the ioctl code for ioctls
+    uint16_t offset;        //byte offset into the first sector, only used by readList
+    uint8_t op;             //DTRACE_op_t
+    uint8_t result;         //DRESULT the call returned
+} DTRACE_record_t;
+
+//header written in front of the records when dumping to a file
+typedef struct __attribute__((packed)){
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t timerFreq;     //core timer frequency in Hz, needed to convert timestamp and latency
+    uint32_t recordCount;   //records following the header
+    uint32_t dropped;       //records that got overwritten before they could be dumped
+} DTRACE_fileHeader_t;
+
+#ifndef DTRACE_HOST_TOOL
+
+#include "ff.h"
+#include "TTerm.h"
+
+#if DTRACE_ENABLED
+
+uint32_t DTRACE_getTime();
+void DTRACE_record(DTRACE_op_t op, uint32_t sector, uint32_t length, uint32_t offset, uint32_t result, uint32_t startTime);
+void DTRACE_setEnabled(uint32_t enabled);
+void DTRACE_clear();
+uint32_t DTRACE_read(DTRACE_record_t * dst, uint32_t maxCount);
+FRESULT DTRACE_dumpToFile(const char * path);
+void DTRACE_dumpToTerminal(TERMINAL_HANDLE * handle);
+
+#define DTRACE_START(var) uint32_t var = DTRACE_getTime()
+#define DTRACE_RESTART(var) var = DTRACE_getTime()
+#define DTRACE_END(var, op, sector, length, offset, result) DTRACE_record(op, sector, length, offset, result, var)
+
+#else
+
+#define DTRACE_START(var)
+#define DTRACE_RESTART(var)
+#define DTRACE_END(var, op, sector, length, offset, result)
+
+#endif
+
+#endif
+
+#endif
@@ -9,8 +9,10 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include "integer.h"
 #include "SPI.h"
+#include "DLL.h"
 
 
 /* Status of Disk Functions */
@@ -26,15 +28,26 @@ typedef enum {
 } DRESULT;
 
 
+/* Selects (1) or deselects (0) a card added with disk_addCard */
+typedef void (* SD_chipSelect_t)(uint32_t selected);
+
+/* Gets the data of disk_readListCB piece by piece, at most one block of the card at a time */
+typedef void (* SD_blockCallback_t)(void * context, BYTE * data, UINT length);
+
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
 void    disk_setSPIHandle(SPIHandle_t * handle);
+void    disk_addCard(BYTE pdrv, SPIHandle_t * handle, SD_chipSelect_t chipSelect);
 DSTATUS disk_initialize (BYTE drv);
+DSTATUS disk_uninitialize (BYTE drv);
 DSTATUS disk_status (BYTE pdrv);
 DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+DRESULT disk_readListCB (BYTE pdrv, BYTE* buff, DLLObject * list, SD_blockCallback_t callback, void * context);
+DRESULT disk_benchmarkReadAhead (BYTE pdrv, BYTE* buff, DWORD sector, UINT count, uint32_t * singleUs, uint32_t * aheadUs);
 
 
 /* Disk Status Bits (DSTATUS) */
@@ -65,6 +78,8 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define MMC_GET_CID			12	/* Get CID */
 #define MMC_GET_OCR			13	/* Get OCR */
 #define MMC_GET_SDSTAT		14	/* Get SD status */
+#define MMC_GET_STATS		15	/* Get driver statistics (MMC_stats_t), works without an initialized card */
+#define MMC_GET_ERASED		16	/* Get the value sectors read as after CTRL_TRIM (1 byte, 0x00 or 0xFF) */
 #define ISDIO_READ			55	/* Read data form SD iSDIO register */
 #define ISDIO_WRITE			56	/* Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/* Masked write data to SD iSDIO register */
@@ -81,6 +96,40 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define CT_SDC		(CT_SD1|CT_SD2)	/* SD */
 #define CT_BLOCK	0x08		/* Block addressing */
 
+
+/* Driver statistics (MMC_GET_STATS). Times are in core timer ticks of timerFreq Hz */
+
+#define MMC_HIST_BUCKETS	32	/* bucket n counts operations that took 2^n to 2^(n+1)-1 ticks */
+
+typedef struct {
+	DWORD timerFreq;
+	DWORD commands;			/* commands sent to the card, CMD55 of ACMDs included */
+	DWORD cmd12Count;		/* STOP_TRANSMISSION commands */
+	DWORD initFailures;		/* failed initialization attempts */
+	DWORD powerUps;			/* card initializations started */
+	uint64_t bytesPIO;		/* bytes moved by the byte wise data block functions */
+	uint64_t bytesFastDMA;	/* bytes moved by the fast dma read path */
+	uint64_t bytesReadList;	/* bytes requested through disk_readList */
+	uint64_t tokenWaitTime;	/* time spent waiting for data tokens */
+	uint64_t busyWaitTime;	/* time spent waiting for the card to become ready */
+	DWORD auSize;			/* allocation unit size in sectors used to split writes, 0 if unknown */
+	DWORD auWrites;			/* write commands issued for multi block writes after splitting them at AU boundaries */
+	DWORD auAlignedWrites;	/* ...of those that started on an AU boundary */
+	DWORD auFullWrites;		/* ...of those that filled a whole AU */
+	DWORD auSplits;			/* writes that had to be split because they crossed an AU boundary */
+	DWORD preemptions;		/* readList transfers interrupted to let a higher priority task use the bus */
+	DWORD lockWaitMax;		/* longest time a task waited for the bus */
+	DWORD lockWaitHist[MMC_HIST_BUCKETS];	/* time tasks waited for the bus */
+	DWORD pfStreams;		/* read-ahead streams started */
+	DWORD pfSectorsServed;	/* sectors disk_read got from the read-ahead ring */
+	DWORD pfSectorsDiscarded;	/* sectors read ahead but never used */
+	DWORD isrCount;			/* dma interrupts of the fast read and read-ahead paths */
+	uint64_t isrTime;		/* time spent inside those interrupts, divide by the MB moved by both paths for the cost per MB */
+	uint64_t fastDMATime;	/* time from the first token to completion of fast dma reads, for their throughput */
+	DWORD readHist[MMC_HIST_BUCKETS];	/* disk_read calls and readList entries */
+	DWORD writeHist[MMC_HIST_BUCKETS];	/* disk_write calls */
+} MMC_stats_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,6 +25,7 @@
 #define _SUPPRESS_PLIB_WARNING
 
 #include <xc.h>
+#include <string.h>
 #include "diskio.h"
 #include "SPI.h"
 #include "FreeRTOS.h"
@@ -32,6 +33,10 @@
 #include "ff.h"
 #include "diskioConfig.h"
 #include "FS.h"
+#include "diskTrace.h"
+#include "FSFreeMap.h"
+#include "diskStripe.h"
+#include "diskPin.h"
 
 /* Definitions for MMC/SDC command */
 #define CMD0   (0)			/* GO_IDLE_STATE */
@@ -49,45 +54,191 @@
 #define ACMD23 (23|0x80)	/* SET_WR_BLK_ERASE_COUNT (SDC) */
 #define CMD24  (24)			/* WRITE_BLOCK */
 #define CMD25  (25)			/* WRITE_MULTIPLE_BLOCK */
+#define CMD32  (32)			/* ERASE_WR_BLK_START */
+#define CMD33  (33)			/* ERASE_WR_BLK_END */
+#define CMD38  (38)			/* ERASE */
 #define CMD41  (41)			/* SEND_OP_COND (ACMD) */
+#define ACMD51 (51|0x80)	/* SEND_SCR (SDC) */
 #define CMD55  (55)			/* APP_CMD */
 #define CMD58  (58)			/* READ_OCR */
 
 
-static volatile DSTATUS Stat = STA_NOINIT;	/* Disk status */
+/* With SD_HC_ONLY set in diskioConfig.h only block addressed SDv2 cards (SDHC/SDXC) are accepted. The addressing and card
+ * type checks then disappear from the read and write paths, as does the SDv1/MMC specific code */
+#ifndef SD_HC_ONLY
+#define SD_HC_ONLY 0
+#endif
 
-static volatile
-uint32_t Timer1, Timer2;		/* 1000Hz decrement timer */
+#if SD_HC_ONLY
+#define SD_ADDR(card, sector)	(sector)
+#define SD_IS_SDC(card)		1
+#else
+#define SD_ADDR(card, sector)	(((card)->cardType & CT_BLOCK) ? (sector) : (sector) * 512)
+#define SD_IS_SDC(card)		((card)->cardType & CT_SDC)
+#endif
 
-static UINT CardType;
+#define CC_CMD23	0x01	/* SET_BLOCK_COUNT, multi block reads end on their own without CMD12 */
+#define CC_ERASED_FF	0x02	/* DATA_STAT_AFTER_ERASE, erased sectors read as 0xFF instead of 0x00 */
 
-#define xmit_spi(dat) 	SPI_send(SD_spiHandle, dat)
-#define rcvr_spi()		SPI_send(SD_spiHandle, 0xff)
-#define rcvr_spi_m(p)	*(p) = SPI_send(SD_spiHandle, 0xff);
+/* Everything the driver knows about one card. Every card sits on its own spi bus, so transfers to different cards can run 
+ * at the same time from different tasks */
+typedef struct{
+    BYTE drive;
+    SPIHandle_t * spiHandle;
+    SD_chipSelect_t chipSelect;         /* NULL for drive 0, which uses CS_x and FCLK_x from diskioConfig.h */
+    SemaphoreHandle_t dmaDone;          /* given by the dma isr once a fast read finished */
+    
+    volatile DSTATUS stat;              /* Disk status */
+    UINT cardType;
+    BYTE cardCaps;                      /* Optional features the card supports (CC_x), read from the SCR during initialization */
+    DWORD auSize;                       /* Allocation unit size in sectors, 0 if unknown or not an SDv2 card */
+    BYTE auValid;                       /* auSize was read since the last initialization */
+    WORD eraseSize;                     /* Erase timing from the SD status: erasing eraseSize AUs takes eraseTimeout s, */
+    BYTE eraseTimeout;                  /* plus eraseOffset s for every erase command. 0 if the card doesn't report it */
+    BYTE eraseOffset;
+    
+    volatile uint32_t busOwned;         /* see SD_lock */
+    volatile UBaseType_t ownerPriority;
+    volatile uint32_t preemptRequests;
+    
+    MMC_stats_t stats;
+} SD_CARD;
+
+static SD_CARD SD_cards[SD_CARD_COUNT];
+
+SPIHandle_t * SD_spiHandle;     /* bus of drive 0 */
+
+#define STATS_TIME() _CP0_GET_COUNT()   /* core timer, runs at half the cpu clock */
+
+#define xmit_spi(card, dat) 	SPI_send((card)->spiHandle, dat)
+#define rcvr_spi(card)		SPI_send((card)->spiHandle, 0xff)
+
+/* Timeouts, measured with the core timer */
+#define CT_TICKS_PER_US		(configCPU_CLOCK_HZ / 2000000)
+#define READY_TIMEOUT_US	100000		/* card busy after a write or command */
+#define TOKEN_TIMEOUT_US	100000		/* data token of a read, 100ms as per spec */
+#define INIT_TIMEOUT_US		1000000		/* leaving the idle state during initialization */
+#define ERASE_TIMEOUT_US	20000000	/* CMD38, CTRL_TRIM splits larger ranges into commands that fit into this */
+#define ERASE_AU_US			250000		/* erase time per AU if the card doesn't report one */
+
+#define TIMED_OUT(start, us)	((STATS_TIME() - (start)) > (us) * CT_TICKS_PER_US)
+
+/* Waiting for the card first spins on the bus for WAIT_SPIN_US, which catches the common case of a card answering within
+ * a few bytes without any scheduler overhead. After that it yields to other ready tasks between polls until WAIT_YIELD_US
+ * and only then falls back to polling once per tick */
+#ifndef WAIT_SPIN_US
+#define WAIT_SPIN_US		200
+#endif
+#ifndef WAIT_YIELD_US
+#define WAIT_YIELD_US		2000
+#endif
+
+#define SD_LOCK_TIMEOUT 1000
+
+/* spi clock of the cards added with disk_addCard, drive 0 uses FCLK_SLOW/FCLK_FAST */
+#ifndef SD_CLK_SLOW
+#define SD_CLK_SLOW 400000
+#endif
+#ifndef SD_CLK_FAST
+#define SD_CLK_FAST 50000000
+#endif
+
+static SD_CARD * card_get(BYTE drv){
+    if(drv >= SD_CARD_COUNT || SD_cards[drv].spiHandle == NULL) return NULL;
+    return &SD_cards[drv];
+}
+
+static void card_setCS(SD_CARD * card, uint32_t selected){
+    if(card->chipSelect){
+        card->chipSelect(selected);
+    }else if(selected){
+        CS_LOW();
+    }else{
+        CS_HIGH();
+    }
+}
+
+static void card_setClock(SD_CARD * card, uint32_t fast){
+    if(card->chipSelect){
+        SPI_setCLKFreq(card->spiHandle, fast ? SD_CLK_FAST : SD_CLK_SLOW);
+    }else if(fast){
+        FCLK_FAST();
+    }else{
+        FCLK_SLOW();
+    }
+}
+
+/* Only drive 0 is power managed by FS.c, the others are always on. card_wake powers the card up if it is asleep, which 
+ * waits for FS_task and that needs the bus itself, so it must only be called by the public entry points before they take
+ * it. Everything running with the bus held uses card_keepAwake, which only renews the timeout of a card that is awake */
+static uint32_t card_wake(SD_CARD * card){
+    return card->drive != 0 || FS_clearPowerTimeout();
+}
 
-#define INIT_TIMEOUT pdMS_TO_TICKS(100)
+static uint32_t card_keepAwake(SD_CARD * card){
+    return card->drive != 0 || FS_renewPowerTimeout();
+}
 
-SPIHandle_t * SD_spiHandle;
+//sorts the time since start into a log2 latency histogram
+static inline void stats_addLatency(DWORD * hist, uint32_t start){
+    uint32_t ticks = STATS_TIME() - start;
+    hist[31 - __builtin_clz(ticks | 1)]++;
+}
 
 /*-----------------------------------------------------------------------*/
 /* Wait for card ready                                                   */
 /*-----------------------------------------------------------------------*/
 
-static BYTE wait_ready (void){
-    if(!FS_clearPowerTimeout()) return 0xff;
-    if(CardType == 0) return 0xff;
+/* Polls the card until it sends 0xFF (waitFF = 1, card is no longer busy) or anything but 0xFF (waitFF = 0, start of a
+ * response or token). Returns the last byte received, which still is the wait condition if the timeout passed.
+ * Erase timeouts run for over a minute, on fast parts longer than the core timer takes to wrap, so the time between two
+ * polls is added up in 64 bits instead of comparing against the start */
+static BYTE wait_card (SD_CARD * card, BYTE waitFF, uint32_t timeoutUs){
 	BYTE res;
+    uint32_t last = STATS_TIME();
+    uint64_t elapsed = 0;
+    uint64_t timeout = (uint64_t) timeoutUs * CT_TICKS_PER_US;
     
-    TickType_t start = xTaskGetTickCount();
+    while(((res = rcvr_spi(card)) == 0xFF) != waitFF){
+        uint32_t now = STATS_TIME();
+        elapsed += now - last;
+        last = now;
+        if(elapsed > timeout) break;
+        
+        if(elapsed > WAIT_YIELD_US * CT_TICKS_PER_US){
+            vTaskDelay(1);
+        }else if(elapsed > WAIT_SPIN_US * CT_TICKS_PER_US){
+            taskYIELD();
+        }
+    }
     
-	rcvr_spi();
-	do
-		res = rcvr_spi();
-	while ((res != 0xFF) && ((xTaskGetTickCount() - start) < INIT_TIMEOUT));
+	return res;
+}
+
+static BYTE wait_ready (SD_CARD * card){
+    if(!card_keepAwake(card)) return 0xff;
+    if(card->cardType == 0) return 0xff;
+	BYTE res;
+    
+    uint32_t busyStart = STATS_TIME();
     
+	rcvr_spi(card);
+	res = wait_card(card, 1, READY_TIMEOUT_US);
+    
+    card->stats.busyWaitTime += STATS_TIME() - busyStart;
 	return res;
 }
 
+/* Waits for the start of a data packet */
+static BYTE wait_token (SD_CARD * card){
+    uint32_t waitStart = STATS_TIME();
+    
+    BYTE token = wait_card(card, 0, TOKEN_TIMEOUT_US);
+    
+    card->stats.tokenWaitTime += STATS_TIME() - waitStart;
+    return token;
+}
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -95,10 +246,10 @@ static BYTE wait_ready (void){
 /*-----------------------------------------------------------------------*/
 
 static
-void deselect (void)
+void deselect (SD_CARD * card)
 {
-	CS_HIGH();
-	rcvr_spi();
+	card_setCS(card, 0);
+	rcvr_spi(card);
 }
 
 
@@ -108,11 +259,11 @@ void deselect (void)
 /*-----------------------------------------------------------------------*/
 
 static
-int select (void)	/* 1:Successful, 0:Timeout */
+int select (SD_CARD * card)	/* 1:Successful, 0:Timeout */
 {
-	CS_LOW();
-	if (wait_ready() != 0xFF) {
-		deselect();
+	card_setCS(card, 1);
+	if (wait_ready(card) != 0xFF) {
+		deselect(card);
 		return 0;
 	}
 	return 1;
@@ -122,66 +273,138 @@ int select (void)	/* 1:Successful, 0:Timeout */
 
 
 /*-----------------------------------------------------------------------*/
-/* Write Sector(s)                                                       */
+/* Bus arbitration between tasks                                         */
 /*-----------------------------------------------------------------------*/
+
+/* The priority of a request is the priority of the task issuing it. Long transfers check preemptRequests of the card at every
+ * block boundary and hand the bus over with SD_yield() if a task with a higher priority than the current owner is waiting */
+
+static void pf_cancelBus (SPIHandle_t * handle, SD_CARD * keep);
+
+static uint32_t SD_take(SD_CARD * card, UBaseType_t priority){
+    uint32_t preempting = 0;
+    uint32_t waitStart = STATS_TIME();
+    
+    taskENTER_CRITICAL();
+    if(card->busOwned && priority > card->ownerPriority){
+        card->preemptRequests++;
+        preempting = 1;
+    }
+    taskEXIT_CRITICAL();
+    
+    BaseType_t taken = xSemaphoreTake(card->spiHandle->semaphore, SD_LOCK_TIMEOUT);
+    
+    taskENTER_CRITICAL();
+    if(preempting) card->preemptRequests--;
+    if(taken){
+        card->busOwned = 1;
+        card->ownerPriority = priority;
+    }
+    taskEXIT_CRITICAL();
+    
+    //the statistics belong to whoever holds the bus, a task that timed out must not touch them
+    if(taken){
+        uint32_t waited = STATS_TIME() - waitStart;
+        if(waited > card->stats.lockWaitMax) card->stats.lockWaitMax = waited;
+        stats_addLatency(card->stats.lockWaitHist, waitStart);
+    }
+    
+    return taken;
+}
+
+/* Takes the bus. A read-ahead stream keeps running on it after disk_read returned, so it gets stopped first. Only disk_read
+ * itself uses SD_take directly, to continue the stream of its card */
+static uint32_t SD_lock(SD_CARD * card, UBaseType_t priority){
+    if(!SD_take(card, priority)) return 0;
+    pf_cancelBus(card->spiHandle, NULL);
+    return 1;
+}
+
+static void SD_unlock(SD_CARD * card){
+    card->busOwned = 0;
+    xSemaphoreGive(card->spiHandle->semaphore);
+}
+
+//hands the bus to whoever is waiting for it and takes it back once they are done. Returns 0 if the bus couldn't be regained
+static uint32_t SD_yield(SD_CARD * card, UBaseType_t priority){
+    SD_unlock(card);
+    taskYIELD();
+    return SD_lock(card, priority);
+}
+
 /*-----------------------------------------------------------------------*/
 /* Send a command packet to MMC                                          */
 /*-----------------------------------------------------------------------*/
 
-static BYTE send_cmd (BYTE cmd, DWORD arg){
-	BYTE n, res, org;
-    org = cmd;
-	if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
-		cmd &= 0x7F;
-		res = send_cmd(CMD55, 0);
-		if (res > 1) return res;
-	}
+/* Sends a plain CMD<n>, the read and write paths use this directly as they never send ACMDs */
+static BYTE xmit_cmd (SD_CARD * card, BYTE cmd, DWORD arg){
+	BYTE n, res;
 
 	/* Select the card and wait for ready */
-	deselect();
-	if (!select()) return 0xFF;
+	deselect(card);
+    card->stats.commands++;
+    if (cmd == CMD12) card->stats.cmd12Count++;
+	if (!select(card)) return 0xFF;
 
 	/* Send command packet */
-	xmit_spi(0x40 | cmd);			/* Start + Command index */
-	xmit_spi((BYTE)(arg >> 24));	/* Argument[31..24] */
-	xmit_spi((BYTE)(arg >> 16));	/* Argument[23..16] */
-	xmit_spi((BYTE)(arg >> 8));		/* Argument[15..8] */
-	xmit_spi((BYTE)arg);			/* Argument[7..0] */
+	xmit_spi(card, 0x40 | cmd);			/* Start + Command index */
+	xmit_spi(card, (BYTE)(arg >> 24));	/* Argument[31..24] */
+	xmit_spi(card, (BYTE)(arg >> 16));	/* Argument[23..16] */
+	xmit_spi(card, (BYTE)(arg >> 8));		/* Argument[15..8] */
+	xmit_spi(card, (BYTE)arg);			/* Argument[7..0] */
 	n = 0x01;						/* Dummy CRC + Stop */
 	if (cmd == CMD0) n = 0x95;		/* Valid CRC for CMD0(0) */
 	if (cmd == CMD8) n = 0x87;		/* Valid CRC for CMD8(0x1AA) */
-	xmit_spi(n);
+	xmit_spi(card, n);
 
 	/* Receive command response */
-	if (cmd == CMD12) rcvr_spi();	/* Skip a stuff byte when stop reading */
+	if (cmd == CMD12) rcvr_spi(card);	/* Skip a stuff byte when stop reading */
 	n = 10;							/* Wait for a valid response in timeout of 10 attempts */
 	do
-		res = rcvr_spi();
+		res = rcvr_spi(card);
 	while ((res & 0x80) && --n);
 
 	return res;			/* Return with the response value */
 }
 
+static BYTE send_cmd (SD_CARD * card, BYTE cmd, DWORD arg){
+	BYTE res;
+	if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
+		cmd &= 0x7F;
+		res = xmit_cmd(card, CMD55, 0);
+		if (res > 1) return res;
+	}
+	return xmit_cmd(card, cmd, arg);
+}
+
+/* Announces the length of the next multi block read if the card supports CMD23, so it doesn't need a CMD12 to end it.
+ * Returns 1 if the count was set */
+static BYTE set_block_count (SD_CARD * card, UINT count){
+	if (!(card->cardCaps & CC_CMD23) || count > 0xFFFF) return 0;
+	return xmit_cmd(card, CMD23, count) == 0;	/* SET_BLOCK_COUNT */
+}
+
 /*-----------------------------------------------------------------------*/
 /* Send a data packet to MMC                                             */
 /*-----------------------------------------------------------------------*/
 
 #if _READONLY == 0
-static int xmit_datablock (const BYTE *buff, BYTE token){
+static int xmit_datablock (SD_CARD * card, const BYTE *buff, BYTE token){
 	BYTE resp;
 	UINT bc = 512;
 
-	if (wait_ready() != 0xFF) return 0;
+	if (wait_ready(card) != 0xFF) return 0;
 
-	xmit_spi(token);		/* Xmit a token */
+	xmit_spi(card, token);		/* Xmit a token */
 	if (token != 0xFD) {	/* Not StopTran token */
 		do {						/* Xmit the 512 byte data block to the MMC */
-			xmit_spi(*buff++);
-			xmit_spi(*buff++);
+			xmit_spi(card, *buff++);
+			xmit_spi(card, *buff++);
 		} while (bc -= 2);
-		xmit_spi(0xFF);				/* CRC (Dummy) */
-		xmit_spi(0xFF);
-		resp = rcvr_spi();			/* Receive a data response */
+		xmit_spi(card, 0xFF);				/* CRC (Dummy) */
+		xmit_spi(card, 0xFF);
+		card->stats.bytesPIO += 512;
+		resp = rcvr_spi(card);			/* Receive a data response */
 		if ((resp & 0x1F) != 0x05)	/* If not accepted, return with error */
 			return 0;
 	}
@@ -191,163 +414,344 @@ static int xmit_datablock (const BYTE *buff, BYTE token){
 #endif	/* _READONLY */
 
 
+static void pf_cancel (SD_CARD * card);
+static void pf_drop (SD_CARD * card);
+
 #if _READONLY == 0
-DRESULT disk_write (BYTE pdrv, const BYTE *buff, DWORD sector, UINT count){
-	if (pdrv || !count) return RES_PARERR;
-	if (Stat & STA_NOINIT) return RES_NOTRDY;
-	if (Stat & STA_PROTECT) return RES_WRPRT;
+static DWORD get_au_size (SD_CARD * card);
 
-	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+/* Writes count blocks with a single command, returns the number of blocks that were not written */
+static UINT xmit_blocks (SD_CARD * card, const BYTE *buff, DWORD sector, UINT count){
+	sector = SD_ADDR(card, sector);	/* Convert to byte address if needed */
 
 	if (count == 1) {		/* Single block write */
-		if ((send_cmd(CMD24, sector) == 0)	/* WRITE_BLOCK */
-			&& xmit_datablock(buff, 0xFE))
+		if ((xmit_cmd(card, CMD24, sector) == 0)	/* WRITE_BLOCK */
+			&& xmit_datablock(card, buff, 0xFE))
 			count = 0;
 	}else {				/* Multiple block write */
-		if (CardType & CT_SDC) send_cmd(ACMD23, count);
-		if (send_cmd(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
+		if (SD_IS_SDC(card)) send_cmd(card, ACMD23, count);	/* Pre-erase the blocks we are about to write */
+		if (xmit_cmd(card, CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
 			do {
-				if (!xmit_datablock(buff, 0xFC)) break;
+				if (!xmit_datablock(card, buff, 0xFC)) break;
 				buff += 512;
 			} while (--count);
-			if (!xmit_datablock(0, 0xFD))	/* STOP_TRAN token */
+			if (!xmit_datablock(card, 0, 0xFD))	/* STOP_TRAN token */
 				count = 1;
 		}
 	}
-	deselect();
+	
+	return count;
+}
+
+static DRESULT mmc_write (SD_CARD * card, const BYTE *buff, DWORD sector, UINT count){
+	if (!count) return RES_PARERR;
+	if (card->stat & STA_NOINIT) return RES_NOTRDY;
+	if (card->stat & STA_PROTECT) return RES_WRPRT;
+    
+    pf_cancel(card);
+
+    //sd cards are only fast if a write stays inside one allocation unit, so split multi block writes at AU boundaries
+    DWORD au = (count > 1) ? get_au_size(card) : 0;
+    
+    while(count){
+        UINT chunk = count;
+        
+        if(au){
+            DWORD auOffset = sector % au;
+            if(chunk > au - auOffset){
+                chunk = au - auOffset;
+                card->stats.auSplits++;
+            }
+            
+            card->stats.auWrites++;
+            if(auOffset == 0) card->stats.auAlignedWrites++;
+            if(chunk == au) card->stats.auFullWrites++;
+        }
+        
+        if(xmit_blocks(card, buff, sector, chunk)) break;
+        
+        buff += chunk * 512;
+        sector += chunk;
+        count -= chunk;
+    }
+	deselect(card);
 
 	return count ? RES_ERROR : RES_OK;
 }
 #endif /* _READONLY */
 
-static void power_on(void){
-	Stat |= STA_NOINIT;	/* Set STA_NOINIT */
+static void power_on(SD_CARD * card){
+	pf_drop(card);
+	card->stat |= STA_NOINIT;	/* Set STA_NOINIT */
+	card->stats.powerUps++;
 }
 
-static void power_off(void){
-	Stat |= STA_NOINIT;	/* Set STA_NOINIT */
+static void power_off(SD_CARD * card){
+	pf_drop(card);
+	card->stat |= STA_NOINIT;	/* Set STA_NOINIT */
 }
 
 /*-----------------------------------------------------------------------*/
 /* Receive a data packet from MMC rather quickly                         */
 /*-----------------------------------------------------------------------*/
 
-#define FRS_WAIT_TOKEN  0
-#define FRS_WAIT_READ   1
-#define FRS_WAIT_SKIP   2
-#define FRS_RETURN_ERROR   0xff
+/* Between two blocks of a multi block read the card sends the crc of the last block, a few 0xFF and the token of the next 
+ * one. Instead of polling for the token inside the isr, these bytes are read with dma in chunks of GAP_READ_BYTES and 
+ * scanned once the chunk is complete. Bytes following the token already belong to the next block and are copied over.
+ * The dma can't change its destination without the cpu, so one short isr per block and chunk remains */
+
+#ifndef GAP_READ_BYTES
+#define GAP_READ_BYTES  16
+#endif
+#define GAP_MAX_CHUNKS  (512 / GAP_READ_BYTES)  /* give up after 512 bytes without a token */
+
+#define GAP_NOT_FOUND   -1
+#define GAP_ERROR       -2
+
+typedef struct{
+    uint8_t bytes[GAP_READ_BYTES];
+    uint32_t skip;      //bytes at the start of the chunk that aren't part of the gap (crc)
+    uint32_t chunks;    //chunks received without a token
+} GAP_t;
+
+//starts reading the next chunk of the gap. The first chunk after a block also contains its crc
+static void gap_start(SD_CARD * card, GAP_t * gap, uint32_t afterBlock){
+    gap->skip = afterBlock ? 2 : 0;     //skip crc TODO calculate crc with dma
+    if(afterBlock) gap->chunks = 0;
+    SPI_continueDMARead(card->spiHandle, gap->bytes, GAP_READ_BYTES, 1, 1);
+}
+
+//returns how many bytes of the next block followed the token in the chunk, or one of the GAP_ codes
+static int32_t gap_scan(GAP_t * gap){
+    for(uint32_t i = gap->skip; i < GAP_READ_BYTES; i++){
+        if(gap->bytes[i] == 0xFF) continue;
+        if(gap->bytes[i] == 0xFE) return GAP_READ_BYTES - i - 1;
+        return GAP_ERROR;   //error token
+    }
+    
+    if(++gap->chunks >= GAP_MAX_CHUNKS) return GAP_ERROR;
+    return GAP_NOT_FOUND;
+}
+
+#define gap_data(gap, count) (&(gap)->bytes[GAP_READ_BYTES - (count)])
+
+static inline void stats_addISRTime(SD_CARD * card, uint32_t start){
+    card->stats.isrTime += STATS_TIME() - start;
+    card->stats.isrCount++;
+}
+
+#define FRS_SKIP_HEAD   0   /* discarding the bytes in front of startOffset */
+#define FRS_WAIT_READ   1   /* reading data into the buffer */
+#define FRS_SKIP_TAIL   2   /* discarding the rest of the last block */
+#define FRS_WAIT_GAP    3   /* looking for the token of the next block */
+#define FRS_RETURN_PREEMPTED   0xfd
 #define FRS_RETURN_OK   0xfe
+#define FRS_RETURN_ERROR   0xff
 
 typedef struct{
-    uint32_t state;
+    volatile uint32_t state;
     uint32_t bytesLeft;
     uint32_t currStartByte;
+    uint32_t currLength;
+    uint32_t tailLeft;
     uint8_t * garbageBin;
     uint8_t * buffer;
-    SPIHandle_t * spiHandle;
-    SemaphoreHandle_t semaphore;
+    SD_CARD * card;
+    volatile uint32_t * preemptRequest;
+    uint32_t notify;        //wake the task after every block, so it can process the data while the next block arrives
+    volatile uint32_t abort;    //set by the task if the card stopped answering, the isr then ends at the next event
+    GAP_t gap;
 } rcvr_ISRDATA;
 
-static void rcvr_fastReadDMAISR(uint32_t evt, void * data){
-    rcvr_ISRDATA * d = (rcvr_ISRDATA *) data;
+static void rcvr_finish(rcvr_ISRDATA * d, uint32_t state){
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    d->state = state;
+    xSemaphoreGiveFromISR(d->card->dmaDone, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+//the current block is complete -> check if we need any more
+static void rcvr_blockDone(rcvr_ISRDATA * d){
+    SD_CARD * card = d->card;
     
-    if(evt & _DCH0INT_CHERIF_MASK){
-        //error!
-        d->state = FRS_RETURN_ERROR;
-        xSemaphoreGiveFromISR(d->semaphore, &xHigherPriorityTaskWoken);
+    if(d->bytesLeft == 0){
+        rcvr_spi(card);
+        rcvr_spi(card); //skip crc
+        rcvr_finish(d, FRS_RETURN_OK);
+    }else if(d->preemptRequest && *d->preemptRequest){
+        //a more important task is waiting for the bus, stop at this block boundary and let the caller hand it over
+        rcvr_spi(card);
+        rcvr_spi(card);
+        rcvr_finish(d, FRS_RETURN_PREEMPTED);
+    }else{
+        d->state = FRS_WAIT_GAP;
+        gap_start(card, &d->gap, 1);
+    }
+}
+
+//the wanted part of the current block is in the buffer -> skip whatever is left in the block
+static void rcvr_dataDone(rcvr_ISRDATA * d){
+    d->bytesLeft -= d->currLength;
+    d->buffer += d->currLength;
+    d->currStartByte = 0;
+
+    if(d->tailLeft){
+        d->state = FRS_SKIP_TAIL;
+        SPI_continueDMARead(d->card->spiHandle, d->garbageBin, d->tailLeft, 1, 1);
+    }else{
+        rcvr_blockDone(d);
+    }
+    
+    //the next dma is running already, let the task work on this block in the meantime
+    if(d->notify && d->state < FRS_RETURN_PREEMPTED){
+        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+        xSemaphoreGiveFromISR(d->card->dmaDone, &xHigherPriorityTaskWoken);
+        portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+    }
+}
+
+//starts reading the wanted part of the current block into the buffer. preRead bytes of the block were already received
+static void rcvr_startData(rcvr_ISRDATA * d, const uint8_t * pre, uint32_t preRead){
+    d->currLength = 512 - d->currStartByte;
+    if(d->currLength > d->bytesLeft) d->currLength = d->bytesLeft;
+    
+    uint32_t copied = (preRead < d->currLength) ? preRead : d->currLength;
+    if(copied) memcpy(d->buffer, pre, copied);
+    d->tailLeft = 512 - d->currStartByte - d->currLength - (preRead - copied);
+    
+    if(copied < d->currLength){
+        d->state = FRS_WAIT_READ;
+        SPI_continueDMARead(d->card->spiHandle, d->buffer + copied, d->currLength - copied, 1, 1);
+    }else{
+        rcvr_dataDone(d);
+    }
+}
+
+static void rcvr_fastReadStep(uint32_t evt, rcvr_ISRDATA * d){
+    if((evt & _DCH0INT_CHERIF_MASK) || d->abort){
+        //error or the task gave up, don't start another transfer
+        rcvr_finish(d, FRS_RETURN_ERROR);
+        return;
     }
     
-    //TODO disable enhanced buffer for pattern match
     switch(d->state){
+        case FRS_SKIP_HEAD:     //we just skipped the bytes in front of the data -> read the data
+            rcvr_startData(d, NULL, 0);
+            return;
             
-        case FRS_WAIT_READ:     //we just got the data -> check if we need any more
-            rcvr_spi();
-            rcvr_spi(); //skip crc TODO calculate crc with dma
-            d->bytesLeft -= (512 - d->currStartByte);
-            d->buffer += (512 - d->currStartByte);
-            d->currStartByte = 0;
-
-            if(d->bytesLeft == 0){
-                d->state = FRS_RETURN_OK;
-                xSemaphoreGiveFromISR(d->semaphore, &xHigherPriorityTaskWoken);
-            }else{
-                //start next read
-                uint32_t count = 512; uint8_t token = 0xff;
-                while(((token = rcvr_spi()) == 0xFF) && --count);
-                if(token == 0xfe){
-                    if(d->bytesLeft >= 512){
-                        SPI_continueDMARead(d->spiHandle, d->buffer, 512, 1, 1);
-                    }else{
-                        d->state = FRS_WAIT_SKIP;
-                        SPI_continueDMARead(d->spiHandle, d->buffer, d->bytesLeft, 1, 1);
-                    }
-                }else{ //error?
-                    d->state = FRS_RETURN_ERROR;
-                    xSemaphoreGiveFromISR(d->semaphore, &xHigherPriorityTaskWoken);
-                }
-            }
+        case FRS_WAIT_READ:     //we just got the data
+            rcvr_dataDone(d);
+            return;
+            
+        case FRS_SKIP_TAIL:     //block is complete
+            rcvr_blockDone(d);
             return;
             
-        case FRS_WAIT_SKIP:     //we just got the data to skip -> continue with normal data
-            if(d->currStartByte != 0){    //we are skipping from the beginning -> just continue with normal read
-                SPI_continueDMARead(d->spiHandle, d->buffer, 512 - d->currStartByte, 1, 1);
-                d->state = FRS_WAIT_READ;
-            }else{ //we received tailing skip data -> read crc and go back to task
-                SPI_continueDMARead(d->spiHandle, d->buffer, 512 - d->bytesLeft, 1, 1);
-                d->currStartByte = 512 - d->bytesLeft;
-                d->state = FRS_WAIT_READ;
+        case FRS_WAIT_GAP: {    //a chunk of the gap between two blocks arrived
+            int32_t dataBytes = gap_scan(&d->gap);
+            if(dataBytes == GAP_NOT_FOUND){
+                gap_start(d->card, &d->gap, 0);
+            }else if(dataBytes == GAP_ERROR){
+                rcvr_finish(d, FRS_RETURN_ERROR);
+            }else{
+                rcvr_startData(d, gap_data(&d->gap, dataBytes), dataBytes);
             }
             return;
+        }
     }
 }
 
-static int rcvr_datablockFast (BYTE *buff, UINT startOffset, UINT btr){
+static void rcvr_fastReadDMAISR(uint32_t evt, void * data){
+    uint32_t isrStart = STATS_TIME();
+    rcvr_ISRDATA * d = (rcvr_ISRDATA *) data;
+    rcvr_fastReadStep(evt, d);
+    stats_addISRTime(d->card, isrStart);
+}
+
+//hands the data between from and to over to the callback, one piece per block of the card. Returns where it stopped
+static BYTE * rcvr_process (BYTE *from, BYTE *to, BYTE *buff, UINT startOffset, SD_blockCallback_t callback, void * context){
+    while(from < to){
+        UINT length = 512 - (from - buff + startOffset) % 512;
+        if(length > to - from) length = to - from;
+        callback(context, from, length);
+        from += length;
+    }
+    return from;
+}
+
+/* Reads btr bytes starting at startOffset of the first block into buff using dma. Blocks are read until btr bytes were 
+ * received, or until a preemption request comes in if preemptRequest isn't NULL. Returns one of the FRS_RETURN_ codes, 
+ * the number of bytes written into buff is stored in received. 
+ * If callback isn't NULL it gets every block as soon as it is in the buffer, while the dma receives the next one. All of
+ * the received bytes were handed to it once this returns, so a transfer resumed after preemption starts with nothing left
+ * over. It may already have seen some of the data if the read fails later on */
+static uint32_t rcvr_datablockFast (SD_CARD * card, BYTE *buff, UINT startOffset, UINT btr, UINT * received, volatile uint32_t * preemptRequest, SD_blockCallback_t callback, void * context){
     rcvr_ISRDATA * isrData = pvPortMalloc(sizeof(rcvr_ISRDATA));
     isrData->buffer = buff;
     isrData->bytesLeft = btr;
-    isrData->spiHandle = SD_spiHandle;
-    isrData->semaphore = SD_spiHandle->semaphore;
+    isrData->card = card;
     isrData->currStartByte = startOffset;
+    isrData->preemptRequest = preemptRequest;
+    isrData->notify = (callback != NULL);
+    isrData->abort = 0;
+    isrData->garbageBin = pvPortMalloc(512);
     
-    uint32_t garbageDataSize = startOffset;
-    if(garbageDataSize < (512 - startOffset)) garbageDataSize = (512 - startOffset);
-    isrData->garbageBin = pvPortMalloc(garbageDataSize);
-    
-    SPI_setDMAEnabled(SD_spiHandle, 1);
-    
-	BYTE token;
+    SPI_setDMAEnabled(card->spiHandle, 1);
+    xSemaphoreTake(card->dmaDone, 0);   //make sure no stale completion is left
     
-	Timer1 = 100;
-	do {							/* Wait for data packet in timeout of 100ms */
-		token = rcvr_spi();
-	} while ((token == 0xFF) && Timer1);
+	BYTE token = wait_token(card);	/* Wait for data packet in timeout of 100ms */
 
-	if(token != 0xFE){ 
-        xSemaphoreGive(SD_spiHandle->semaphore);
-        return 0;		/* If not valid data token, return with error */
-    }
-    
-    //token received correctly -> card is ready to give us the d(ata) kekW
-    if(startOffset == 0){   //any offset?
-        //no -> start normal read
-        isrData->state = FRS_WAIT_READ;
-        SPI_sendBytes(SD_spiHandle, buff, 512, 1, 1, rcvr_fastReadDMAISR, isrData);
+    uint32_t ret = FRS_RETURN_ERROR;
+	if(token == 0xFE){ 
+        uint32_t transferStart = STATS_TIME();
         
-    }else{
-        //yes -> start offset read
-        isrData->state = FRS_WAIT_SKIP;
-        SPI_sendBytes(SD_spiHandle, isrData->garbageBin, startOffset, 1, 1, rcvr_fastReadDMAISR, isrData);
+        //token received correctly -> card is ready to give us the d(ata) kekW
+        if(startOffset == 0){   //any offset?
+            //no -> start normal read
+            isrData->state = FRS_WAIT_READ;
+            isrData->currLength = (btr < 512) ? btr : 512;
+            isrData->tailLeft = 512 - isrData->currLength;
+            SPI_sendBytes(card->spiHandle, buff, isrData->currLength, 1, 1, rcvr_fastReadDMAISR, isrData);
+        }else{
+            //yes -> start offset read
+            isrData->state = FRS_SKIP_HEAD;
+            SPI_sendBytes(card->spiHandle, isrData->garbageBin, startOffset, 1, 1, rcvr_fastReadDMAISR, isrData);
+        }
+
+        //the isr only signals completion, unless there is a callback to run after every block
+        BYTE * processed = buff;
+        while(isrData->state < FRS_RETURN_PREEMPTED){
+            if(!xSemaphoreTake(card->dmaDone, 1000)){
+                //the transfer stalled. A card that stops sending tokens can't cause this, the gap scan gives up with an
+                //error after GAP_MAX_CHUNKS. Make the isr stop at the end of the transfer that is running now, which always
+                //completes as we clock it ourselves
+                isrData->abort = 1;
+                while(isrData->state < FRS_RETURN_PREEMPTED){
+                    if(!xSemaphoreTake(card->dmaDone, 100)) break;
+                }
+                break;
+            }
+            if(callback) processed = rcvr_process(processed, isrData->buffer, buff, startOffset, callback, context);
+        }
+        if(isrData->state >= FRS_RETURN_PREEMPTED && !isrData->abort) ret = isrData->state;
+        
+        //the isr doesn't signal the last block separately, it arrived together with the end of the transfer
+        if(callback && ret != FRS_RETURN_ERROR) rcvr_process(processed, isrData->buffer, buff, startOffset, callback, context);
+        card->stats.fastDMATime += STATS_TIME() - transferStart;
     }
     
-    uint32_t ret = btr;
-    if(!xSemaphoreTake(SD_spiHandle->semaphore, 1000)) ret = 0;
+    //only count what made it into the buffer completely
+    *received = (ret == FRS_RETURN_ERROR) ? 0 : btr - isrData->bytesLeft;
+    
+    SPI_setDMAEnabled(card->spiHandle, 0);
     
-    if(isrData->state != FRS_RETURN_OK) ret = btr - isrData->bytesLeft;
+    //if the isr never confirmed the abort the dma might still write into isrData, better lose the memory than corrupt the heap
+    if(isrData->state >= FRS_RETURN_PREEMPTED || token != 0xFE){
+        vPortFree(isrData->garbageBin);
+        vPortFree(isrData);
+    }
     
-    vPortFree(isrData->garbageBin);
-    vPortFree(isrData);
-    SPI_setDMAEnabled(SD_spiHandle, 0);
+    card->stats.bytesFastDMA += *received;
 
 	return ret;
 }
@@ -355,94 +759,460 @@ static int rcvr_datablockFast (BYTE *buff, UINT startOffset, UINT btr){
 /*-----------------------------------------------------------------------*/
 /* Receive a data packet from MMC                                        */
 /*-----------------------------------------------------------------------*/
-static int rcvr_datablock (BYTE *buff, UINT btr){
-	BYTE token;
-    
-	for(uint32_t i = 0; i < 100; i++){							/* Wait for data packet in timeout of 100ms */
-		token = rcvr_spi();
-        if(token != 0xff){
-            break;
-        }
-        vTaskDelay(1);
-	}
+static int rcvr_datablock (SD_CARD * card, BYTE *buff, UINT btr){
+	BYTE token = wait_token(card);	/* Wait for data packet in timeout of 100ms */
 
 	if(token != 0xFE){ 
         return 0;		/* If not valid data token, retutn with error */
     }
     
-    //SPI_setDMAEnabled(SD_spiHandle, 1);
-    SPI_sendBytes(SD_spiHandle, buff, btr, 1, 1, NULL, NULL);
-    //SPI_setDMAEnabled(SD_spiHandle, 0);
+    //SPI_setDMAEnabled(card->spiHandle, 1);
+    SPI_sendBytes(card->spiHandle, buff, btr, 1, 1, NULL, NULL);
+    //SPI_setDMAEnabled(card->spiHandle, 0);
     
-	rcvr_spi();						/* Discard CRC */
-	rcvr_spi();
+	rcvr_spi(card);						/* Discard CRC */
+	rcvr_spi(card);
+    
+    card->stats.bytesPIO += btr;
 
 	return 1;						/* Return with success */
 }
 
-void disk_setSPIHandle(SPIHandle_t * handle){
-    SD_spiHandle = handle;
+/*-----------------------------------------------------------------------*/
+/* Sequential read-ahead                                                 */
+/*-----------------------------------------------------------------------*/
+
+/* Once disk_read was called PF_TRIGGER times in a row for consecutive sectors, an open ended CMD18 is started that keeps a 
+ * ring of PF_RING_BLOCKS sectors filled in the background using dma, also after disk_read released the bus. Following 
+ * sequential reads are served from the ring. The card simply stalls while the ring is full, as it doesn't get any clocks.
+ * Anyone else taking the bus (SD_lock, this includes powering the card down) stops the stream with CMD12 first and throws
+ * the ring away. disk_benchmarkReadAhead compares it against plain single block reads */
+
+#ifndef PF_ENABLED
+#define PF_ENABLED 1
+#endif
+#ifndef PF_RING_BLOCKS
+#define PF_RING_BLOCKS 8
+#endif
+#ifndef PF_TRIGGER
+#define PF_TRIGGER 2
+#endif
+
+#if PF_ENABLED
+
+typedef struct{
+    uint32_t active;                //the ring holds the sectors following readSector
+    uint32_t open;                  //a CMD18 is open and feeding the ring
+    volatile uint32_t dmaRunning;   //a block is being received into the ring right now
+    volatile uint32_t stop;         //don't start any more blocks
+    volatile uint32_t error;
+    volatile uint32_t filled;       //slots holding data that wasn't read yet
+    uint32_t head;                  //slot the next block from the card goes into
+    uint32_t tail;                  //oldest filled slot
+    DWORD readSector;               //sector held by the tail slot
+    DWORD lastEnd;                  //sector following the last disk_read, for detecting sequential access
+    uint32_t sequentialCount;
+    uint32_t bypass;                //read everything with CMD17/18, for disk_benchmarkReadAhead
+    uint32_t state;                 //PF_WAIT_READ or PF_WAIT_GAP
+    GAP_t gap;
+    SemaphoreHandle_t signal;       //given by the isr whenever a block arrived or the dma stopped
+    uint8_t ring[PF_RING_BLOCKS][512];
+} PF_STATE;
+
+#define PF_WAIT_READ    0
+#define PF_WAIT_GAP     1
+
+static PF_STATE PF[SD_CARD_COUNT];
+
+static void pf_ISRStep(SD_CARD * card, uint32_t evt){
+    PF_STATE * pf = &PF[card->drive];
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    
+    if(evt & _DCH0INT_CHERIF_MASK){
+        pf->error = 1;
+    }else if(pf->state == PF_WAIT_GAP){
+        //a chunk of the gap between two blocks arrived
+        int32_t dataBytes = gap_scan(&pf->gap);
+        if(dataBytes == GAP_NOT_FOUND){
+            gap_start(card, &pf->gap, 0);
+            return;
+        }
+        if(dataBytes != GAP_ERROR){
+            memcpy(pf->ring[pf->head], gap_data(&pf->gap, dataBytes), dataBytes);
+            pf->state = PF_WAIT_READ;
+            SPI_continueDMARead(card->spiHandle, pf->ring[pf->head] + dataBytes, 512 - dataBytes, 1, 1);
+            return;
+        }
+        pf->error = 1;
+    }else{
+        //a block arrived
+        pf->filled++;
+        if(++pf->head == PF_RING_BLOCKS) pf->head = 0;
+        
+        //room for another block? Then get it right away, otherwise the card waits until we continue
+        if(pf->filled < PF_RING_BLOCKS && !pf->stop){
+            pf->state = PF_WAIT_GAP;
+            gap_start(card, &pf->gap, 1);
+            xSemaphoreGiveFromISR(pf->signal, &xHigherPriorityTaskWoken);
+            portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+            return;
+        }
+        
+        rcvr_spi(card);
+        rcvr_spi(card); //skip crc
+    }
+    
+    pf->dmaRunning = 0;
+    xSemaphoreGiveFromISR(pf->signal, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
-//allows software to tell us that the card was externally shutdown (f.e. powered off) and it needs to be re-initialized
-DSTATUS disk_uninitialize (BYTE drv){
-    //set STA_NOINIT bit
-	power_off();		
+static void pf_ISR(uint32_t evt, void * data){
+    uint32_t isrStart = STATS_TIME();
+    SD_CARD * card = (SD_CARD *) data;
+    pf_ISRStep(card, evt);
+    stats_addISRTime(card, isrStart);
 }
 
-DSTATUS disk_initialize (BYTE drv){
-    //check if disk is already initialized
-    if(!(Stat & STA_NOINIT)) return 0;  //already initialized
+//gets the next block into the ring if the dma stalled because the ring was full
+static uint32_t pf_resume(SD_CARD * card){
+    PF_STATE * pf = &PF[card->drive];
+    taskENTER_CRITICAL();
+    uint32_t start = pf->open && !pf->dmaRunning && !pf->stop && !pf->error && pf->filled < PF_RING_BLOCKS;
+    if(start) pf->dmaRunning = 1;
+    taskEXIT_CRITICAL();
+    
+    if(!start) return !pf->error;
     
-	BYTE n, cmd, ty, ocr[4];
+    if(wait_token(card) != 0xFE){
+        pf->dmaRunning = 0;
+        pf->error = 1;
+        return 0;
+    }
+    pf->state = PF_WAIT_READ;
+    SPI_sendBytes(card->spiHandle, pf->ring[pf->head], 512, 1, 1, pf_ISR, card);
+    return 1;
+}
+
+//opens the CMD18 at the first sector that isn't in the ring yet
+static uint32_t pf_open (SD_CARD * card){
+    PF_STATE * pf = &PF[card->drive];
+    
+    if(xmit_cmd(card, CMD18, SD_ADDR(card, pf->readSector + pf->filled)) != 0){	/* READ_MULTIPLE_BLOCK, open ended */
+        deselect(card);
+        return 0;
+    }
+    
+    pf->open = 1;
+    pf->stop = 0;
+    pf->error = 0;
+    SPI_setDMAEnabled(card->spiHandle, 1);
+    return pf_resume(card);
+}
+
+static uint32_t pf_start (SD_CARD * card, DWORD sector){
+    PF_STATE * pf = &PF[card->drive];
+    if(pf->signal == NULL) return 0;
     
-    FS_clearPowerTimeout();
+    pf->active = 1;
+    pf->filled = 0;
+    pf->head = 0;
+    pf->tail = 0;
+    pf->readSector = sector;
+    card->stats.pfStreams++;
     
-    CardType = 0;
-	power_on();							/* Force socket power on */
-    FCLK_SLOW();
-	CS_HIGH();
-	for (n = 80; n; n--) rcvr_spi();	/* 80 dummy clocks */
+    if(pf_open(card)) return 1;
+    
+    pf_cancel(card);
+    return 0;
+}
+
+//stops the background dma, the card is left in the middle of the CMD18
+static void pf_stopDMA(SD_CARD * card){
+    PF_STATE * pf = &PF[card->drive];
+    pf->stop = 1;
+    while(pf->dmaRunning){
+        if(!xSemaphoreTake(pf->signal, 100)) break;
+    }
+    pf->dmaRunning = 0;
+}
+
+/* Lets the block currently being received finish and ends the CMD18, so the card is deselected and idle. The ring keeps
+ * its contents */
+static void pf_park (SD_CARD * card){
+    PF_STATE * pf = &PF[card->drive];
+    if(!pf->open) return;
+    
+    pf_stopDMA(card);
+    SPI_setDMAEnabled(card->spiHandle, 0);
+    pf->open = 0;
+    
+    xmit_cmd(card, CMD12, 0);				/* STOP_TRANSMISSION */
+    deselect(card);
+}
+
+/* Throws the ring away and starts counting sequential reads from scratch, the bus must be owned by the caller */
+static void pf_cancel (SD_CARD * card){
+    PF_STATE * pf = &PF[card->drive];
+    pf->sequentialCount = 0;
+    if(!pf->active) return;
+    
+    pf_park(card);
+    
+    card->stats.pfSectorsDiscarded += pf->filled;
+    pf->active = 0;
+    pf->filled = 0;
+}
+
+/* Forgets about the stream without talking to the card, used when it gets powered down or reinitialized */
+static void pf_drop (SD_CARD * card){
+    PF_STATE * pf = &PF[card->drive];
+    pf->sequentialCount = 0;
+    if(!pf->active) return;
+    
+    if(pf->open){
+        pf_stopDMA(card);
+        SPI_setDMAEnabled(card->spiHandle, 0);
+    }
+    pf->open = 0;
+    pf->active = 0;
+    pf->filled = 0;
+}
+
+//copies count sectors from the ring into buff, waiting for the dma where needed
+static uint32_t pf_serve (SD_CARD * card, BYTE * buff, UINT count){
+    PF_STATE * pf = &PF[card->drive];
+    //keep the card awake, nothing else renews its timeout while we are reading from the ring
+    card_keepAwake(card);
+    
+    while(count){
+        while(pf->filled == 0){
+            if(!pf_resume(card)) return 0;
+            if(!xSemaphoreTake(pf->signal, 100) && pf->filled == 0) return 0;
+        }
+        
+        memcpy(buff, pf->ring[pf->tail], 512);
+        buff += 512;
+        count--;
+        
+        if(++pf->tail == PF_RING_BLOCKS) pf->tail = 0;
+        pf->readSector++;
+        card->stats.pfSectorsServed++;
+        
+        taskENTER_CRITICAL();
+        pf->filled--;
+        taskEXIT_CRITICAL();
+        
+        //a slot just became free, make sure the dma continues reading ahead
+        if(!pf_resume(card)) return 0;
+    }
+    return 1;
+}
+
+/* Serves the read from the ring or starts a new stream if the access pattern looks sequential. Returns 0 if the caller 
+ * needs to read the data the normal way. The stream keeps running once this returns */
+static uint32_t pf_read (SD_CARD * card, BYTE * buff, DWORD sector, UINT count){
+    PF_STATE * pf = &PF[card->drive];
+    if(pf->bypass){
+        pf_cancel(card);
+        return 0;
+    }
+    
+    uint32_t sequential = (sector == pf->lastEnd);
+    pf->lastEnd = sector + count;
+    
+    if(pf->active){
+        //skip over sectors the caller isn't interested in if they are already in the ring
+        while(sector > pf->readSector && sector - pf->readSector <= pf->filled && pf->filled){
+            if(++pf->tail == PF_RING_BLOCKS) pf->tail = 0;
+            pf->readSector++;
+            card->stats.pfSectorsDiscarded++;
+            taskENTER_CRITICAL();
+            pf->filled--;
+            taskEXIT_CRITICAL();
+        }
+        
+        if(sector == pf->readSector && pf_serve(card, buff, count)) return 1;
+        
+        //somewhere else or the stream failed, stop it and read normally
+        pf_cancel(card);
+        return 0;
+    }
+    
+    if(!sequential){
+        pf->sequentialCount = 0;
+        return 0;
+    }
+    if(++pf->sequentialCount < PF_TRIGGER) return 0;
+    
+    if(!pf_start(card, sector)) return 0;
+    if(pf_serve(card, buff, count)) return 1;
+    
+    pf_cancel(card);
+    return 0;
+}
+
+//stops the streams of every card on the bus but keep, called with the bus held
+static void pf_cancelBus (SPIHandle_t * handle, SD_CARD * keep){
+    for(uint32_t i = 0; i < SD_CARD_COUNT; i++){
+        if(SD_cards[i].spiHandle == handle && &SD_cards[i] != keep) pf_cancel(&SD_cards[i]);
+    }
+}
+
+static void pf_setBypass (SD_CARD * card, uint32_t bypass){
+    PF[card->drive].bypass = bypass;
+}
+
+#else
+
+static void pf_cancel (SD_CARD * card){}
+static void pf_drop (SD_CARD * card){}
+static void pf_cancelBus (SPIHandle_t * handle, SD_CARD * keep){}
+static void pf_setBypass (SD_CARD * card, uint32_t bypass){}
+#define pf_read(card, buff, sector, count) 0
+
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Read the allocation unit size from the SD status                      */
+/*-----------------------------------------------------------------------*/
+
+static const DWORD AUSizeTable[16] = {	/* AU_SIZE field of the SD status -> sectors */
+	0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072
+};
+
+static int read_au_size (SD_CARD * card, DWORD *au){
+	BYTE n, sdstat[16];
+
+	if (send_cmd(card, ACMD13, 0) != 0) return 0;		/* Read SD status */
+	rcvr_spi(card);
+	if (!rcvr_datablock(card, sdstat, 16)) return 0;	/* Read partial block */
+	for (n = 64 - 16; n; n--) rcvr_spi(card);		/* Purge trailing data */
+	
+	*au = AUSizeTable[sdstat[10] >> 4];
+	card->eraseSize = ((WORD)sdstat[11] << 8) | sdstat[12];
+	card->eraseTimeout = sdstat[13] >> 2;
+	card->eraseOffset = sdstat[13] & 3;
+	return 1;
+}
+
+/* AU size of the card in sectors, read once per initialization. 0 if the card doesn't report one */
+static DWORD get_au_size (SD_CARD * card){
+	if (!card->auValid) {
+		if (!(card->cardType & CT_SD2) || !read_au_size(card, &card->auSize)) card->auSize = 0;
+		card->auValid = 1;
+		card->stats.auSize = card->auSize;
+	}
+	return card->auSize;
+}
+
+/* Number of AUs a single CMD38 may erase to finish within ERASE_TIMEOUT_US, and the time it may take for them */
+static DWORD erase_au_count (SD_CARD * card, uint32_t *timeoutUs){
+	uint32_t auUs = ERASE_AU_US, offsetUs = 0;
+	if (card->eraseSize && card->eraseTimeout) {
+		auUs = (uint32_t)card->eraseTimeout * 1000000 / card->eraseSize;
+		offsetUs = (uint32_t)card->eraseOffset * 1000000;
+	}
+	
+	DWORD count = (ERASE_TIMEOUT_US > offsetUs) ? (ERASE_TIMEOUT_US - offsetUs) / auUs : 0;
+	if (count == 0) count = 1;	/* slow card, a single AU takes longer than the timeout */
+	
+	*timeoutUs = count * auUs + offsetUs;
+	if (*timeoutUs < ERASE_TIMEOUT_US) *timeoutUs = ERASE_TIMEOUT_US;
+	return count;
+}
+
+/* Registers the card on the bus of handle as drive pdrv. chipSelect gets called with 1 to select the card and with 0 to 
+ * deselect it. Drive 0 may pass NULL to use CS_LOW/CS_HIGH and FCLK_SLOW/FCLK_FAST from diskioConfig.h instead, other
+ * drives are ignored without one as those macros only drive card 0 */
+void disk_addCard(BYTE pdrv, SPIHandle_t * handle, SD_chipSelect_t chipSelect){
+    if(pdrv >= SD_CARD_COUNT || (pdrv != 0 && chipSelect == NULL)) return;
+    SD_CARD * card = &SD_cards[pdrv];
+    
+    if(card->spiHandle == NULL){
+        card->drive = pdrv;
+        card->stat = STA_NOINIT;
+        card->stats.timerFreq = configCPU_CLOCK_HZ / 2;
+        card->dmaDone = xSemaphoreCreateBinary();
+#if PF_ENABLED
+        PF[pdrv].signal = xSemaphoreCreateBinary();
+#endif
+    }
+    
+    card->chipSelect = chipSelect;
+    card->spiHandle = handle;
+    if(pdrv == 0) SD_spiHandle = handle;
+}
+
+void disk_setSPIHandle(SPIHandle_t * handle){
+    disk_addCard(0, handle, NULL);
+}
+
+static DSTATUS mmc_initialize (SD_CARD * card){
+    //check if disk is already initialized
+    if(!(card->stat & STA_NOINIT)) return 0;  //already initialized
+    
+	BYTE n, ty, ocr[4], scr[8];
+    
+    card->cardType = 0;
+    card->cardCaps = 0;
+	power_on(card);							/* Force socket power on */
+    card_setClock(card, 0);
+	card_setCS(card, 0);
+	for (n = 80; n; n--) rcvr_spi(card);	/* 80 dummy clocks */
                     //TERM_printDebug(TERM_handle, "dummmmmmb clock done\r\n");
     
 	ty = 0;
-	if (send_cmd(CMD0, 0) == 1) {			/* Enter Idle state */
-		Timer1 = 1000;						/* Initialization timeout of 1000 msec */
-		if (send_cmd(CMD8, 0x1AA) == 1) {	/* SDv2? */
+	if (send_cmd(card, CMD0, 0) == 1) {			/* Enter Idle state */
+		uint32_t initStart = STATS_TIME();	/* Initialization timeout of 1000 msec */
+		if (send_cmd(card, CMD8, 0x1AA) == 1) {	/* SDv2? */
                     //TERM_printDebug(TERM_handle, "SDV2\r\n");
-			for (n = 0; n < 4; n++) ocr[n] = rcvr_spi();			/* Get trailing return value of R7 resp */
+			for (n = 0; n < 4; n++) ocr[n] = rcvr_spi(card);			/* Get trailing return value of R7 resp */
 			if (ocr[2] == 0x01 && ocr[3] == 0xAA) {				/* The card can work at vdd range of 2.7-3.6V */
-				while (--Timer1 && send_cmd(ACMD41, 0x40000000));	/* Wait for leaving idle state (ACMD41 with HCS bit) */
-				if (Timer1 && send_cmd(CMD58, 0) == 0) {			/* Check CCS bit in the OCR */
-					for (n = 0; n < 4; n++) ocr[n] = rcvr_spi();
+				while (!TIMED_OUT(initStart, INIT_TIMEOUT_US) && send_cmd(card, ACMD41, 0x40000000));	/* Wait for leaving idle state (ACMD41 with HCS bit) */
+				if (!TIMED_OUT(initStart, INIT_TIMEOUT_US) && send_cmd(card, CMD58, 0) == 0) {			/* Check CCS bit in the OCR */
+					for (n = 0; n < 4; n++) ocr[n] = rcvr_spi(card);
 					ty = (ocr[0] & 0x40) ? CT_SD2|CT_BLOCK : CT_SD2;	/* SDv2 */
+					if (send_cmd(card, ACMD51, 0) == 0 && rcvr_datablock(card, scr, 8)) {	/* Read SCR */
+						if (scr[3] & 0x02) card->cardCaps |= CC_CMD23;		/* CMD_SUPPORT: CMD23 */
+						if (scr[1] & 0x80) card->cardCaps |= CC_ERASED_FF;	/* DATA_STAT_AFTER_ERASE */
+					}
+#if SD_HC_ONLY
+					if (!(ty & CT_BLOCK)) ty = 0;		/* Byte addressed SDv2 cards aren't supported by this build */
+#endif
 				}else{
                     //TERM_printDebug(TERM_handle, "SD Command Timeout!\r\n");
                 }
 			}
-		} else {							/* SDv1 or MMCv3 */
+		}
+#if !SD_HC_ONLY
+		else {							/* SDv1 or MMCv3 */
                     //TERM_printDebug(TERM_handle, "SDV1\r\n");
-			if (send_cmd(ACMD41, 0) <= 1) 	{
+			BYTE cmd;
+			if (send_cmd(card, ACMD41, 0) <= 1) 	{
 				ty = CT_SD1; cmd = ACMD41;	/* SDv1 */
 			} else {
 				ty = CT_MMC; cmd = CMD1;	/* MMCv3 */
 			}
-			while (--Timer1 && send_cmd(cmd, 0));		/* Wait for leaving idle state */
-			if (!Timer1 || send_cmd(CMD16, 512) != 0)	/* Set read/write block length to 512 */
+			while (!TIMED_OUT(initStart, INIT_TIMEOUT_US) && send_cmd(card, cmd, 0));		/* Wait for leaving idle state */
+			if (TIMED_OUT(initStart, INIT_TIMEOUT_US) || send_cmd(card, CMD16, 512) != 0)	/* Set read/write block length to 512 */
 				ty = 0;
 		}
+#endif
 	}
-	CardType = ty;
-	deselect();
+	card->cardType = ty;
+	card->auValid = 0;
+	deselect(card);
 
 	if (ty) {			/* Initialization succeded */
-		Stat &= ~STA_NOINIT;	/* Clear STA_NOINIT */
-		FCLK_FAST();
+		card->stat &= ~STA_NOINIT;	/* Clear STA_NOINIT */
+		card_setClock(card, 1);
 	} else {			/* Initialization failed */
-		power_off();
+		card->stats.initFailures++;
+		power_off(card);
 	}
 
-	return Stat;
+	return card->stat;
 }
 
 
@@ -452,57 +1222,101 @@ DSTATUS disk_initialize (BYTE drv){
 /*-----------------------------------------------------------------------*/
 
 DSTATUS disk_status (BYTE drv){
-	if (drv) return STA_NOINIT;		/* Supports only single drive */
-	return Stat;
+#if SD_STRIPE_ENABLED
+	if (drv == SD_STRIPE_DRIVE) return STRIPE_status();
+#endif
+	SD_CARD * card = card_get(drv);
+	if (card == NULL) return STA_NOINIT;
+	return card->stat;
 }
 
 
-DRESULT disk_readList (BYTE pdrv, BYTE* buff, DLLObject * list){
-    if(!xSemaphoreTake(SD_spiHandle->semaphore, 1000)) return RES_ERROR;
-    
-    if (pdrv) return RES_PARERR;
-	if (Stat & STA_NOINIT) return RES_NOTRDY;
-
+/* Reads a list of ff_readListData_t entries into buff, one after the other. The bus is only held between block boundaries 
+ * while a task with a higher priority than the caller waits for it, long lists are split up and resumed afterwards.
+ * callback (if not NULL) is run on every block of data in order, while the dma is busy with the next one */
+DRESULT disk_readListCB (BYTE pdrv, BYTE* buff, DLLObject * list, SD_blockCallback_t callback, void * context){
+#if SD_STRIPE_ENABLED
+    if (pdrv == SD_STRIPE_DRIVE) return STRIPE_readList(buff, list, callback, context);
+#endif
+    SD_CARD * card = card_get(pdrv);
     ff_readListData_t * currObj = NULL;
-    FRESULT result = FR_OK;
+    DRESULT result = RES_OK;
+    UBaseType_t priority = uxTaskPriorityGet(NULL);
+    uint32_t locked = 0;
     
-    while((currObj = DLL_pop(list))){
-        //get address to start reading at
-        uint32_t startSectorAdress = currObj->startSector;
-        if (!(CardType & CT_BLOCK)) startSectorAdress *= 512;	/* Convert to byte address if needed */
+    //a card in low power mode is STA_NOINIT until FS_task powered it up again, so wake it before checking
+    if (card != NULL) card_wake(card);
+    
+    if (card == NULL) result = RES_PARERR;
+	else if (card->stat & STA_NOINIT) result = RES_NOTRDY;
+    else if (!(locked = SD_lock(card, priority))) result = RES_ERROR;
+    else pf_cancel(card);
+    
+    uint32_t entryStart;
+    
+    while(result == RES_OK && (currObj = DLL_pop(list))){
+        entryStart = STATS_TIME();
+        
+        card->stats.bytesReadList += currObj->bytesToRead;
         
-        uint32_t sectorsToRead = currObj->bytesToRead / 512; //TODO dynamic sector sizes!
+        DWORD sector = currObj->startSector;
+        UINT offset = currObj->startByte;
+        UINT bytesLeft = currObj->bytesToRead;
         
-        if(sectorsToRead <= 1){
-            if ((send_cmd(CMD17, startSectorAdress) == 0)){
-                if(!rcvr_datablockFast(buff, currObj->startByte, currObj->bytesToRead)){ 
-                    result = FR_DISK_ERR;
+        while(bytesLeft){
+            //is anyone more important waiting for the bus? Then let them go first
+            if(card->preemptRequests){
+                deselect(card);
+                if(!(locked = SD_yield(card, priority))){
+                    result = RES_ERROR;
                     break;
                 }
-            }else{
-                result = FR_DISK_ERR;
-                break;
             }
-        }else{
-            if (send_cmd(CMD18, startSectorAdress) == 0) {	/* READ_MULTIPLE_BLOCK */
-                uint32_t success = rcvr_datablockFast(buff, currObj->startByte, currObj->bytesToRead);
-                send_cmd(CMD12, 0);				/* STOP_TRANSMISSION */
-                if (!success){ 
-                    result = FR_DISK_ERR;
-                    break;
+            
+            //get address to start reading at
+            DWORD startSectorAdress = SD_ADDR(card, sector);	/* Convert to byte address if needed */
+            
+            UINT sectorsToRead = (offset + bytesLeft + 511) / 512; //TODO dynamic sector sizes!
+            UINT received = 0;
+            uint32_t state = FRS_RETURN_ERROR;
+            
+            if(sectorsToRead == 1){
+                if (xmit_cmd(card, CMD17, startSectorAdress) == 0) {	/* READ_SINGLE_BLOCK */
+                    state = rcvr_datablockFast(card, buff, offset, bytesLeft, &received, NULL, callback, context);
                 }
+            }else{
+                BYTE preset = set_block_count(card, sectorsToRead);
+                if (xmit_cmd(card, CMD18, startSectorAdress) == 0) {	/* READ_MULTIPLE_BLOCK */
+                    state = rcvr_datablockFast(card, buff, offset, bytesLeft, &received, &card->preemptRequests, callback, context);
+                    //the card only stops on its own if all blocks were read
+                    if (!preset || state != FRS_RETURN_OK) xmit_cmd(card, CMD12, 0);	/* STOP_TRANSMISSION */
+                }
+            }
+            
+            if(state == FRS_RETURN_ERROR){
+                result = RES_ERROR;
+                break;
             }
+            
+            //a preempted transfer always stops at a block boundary, continue at the next block afterwards. The callback has
+            //seen everything up to there, so the resumed transfer picks up right where it stopped
+            if(state == FRS_RETURN_PREEMPTED) card->stats.preemptions++;
+            buff += received;
+            sector += (offset + received) / 512;
+            offset = 0;
+            bytesLeft -= received;
         }
+        
+        stats_addLatency(card->stats.readHist, entryStart);
+        DTRACE_END(entryStart, DTRACE_OP_READLIST, currObj->startSector, currObj->bytesToRead, currObj->startByte, result);
         vPortFree(currObj);
         currObj = NULL;
     }
     
-    //free incase we broke out of the loop, won't do anything if NULL 
-    vPortFree(currObj);
-    
-	deselect();
-    
-    uint32_t count = DLL_length(list);
+    if(locked){
+        deselect(card);
+        SD_unlock(card);
+    }
     
     //empty list if anything remains
     while((currObj = DLL_pop(list))){
@@ -511,75 +1325,74 @@ DRESULT disk_readList (BYTE pdrv, BYTE* buff, DLLObject * list){
     }
     
     DLL_free(list);
-    
-    xSemaphoreGive(SD_spiHandle->semaphore);
 
-	return count ? RES_ERROR : result;
+	return result;
+}
+
+DRESULT disk_readList (BYTE pdrv, BYTE* buff, DLLObject * list){
+    return disk_readListCB(pdrv, buff, list, NULL, NULL);
+}
+
+/* Reads count sectors starting at sector one at a time with disk_read, like f_read of a file in small pieces does. The 
+ * first pass bypasses the read-ahead and gets every sector with a CMD17, the second one goes through the read-ahead. The
+ * average time per sector in us is stored in singleUs and aheadUs. buff needs room for one sector, keep count below a few
+ * thousand so the core timer doesn't wrap */
+DRESULT disk_benchmarkReadAhead (BYTE pdrv, BYTE* buff, DWORD sector, UINT count, uint32_t * singleUs, uint32_t * aheadUs){
+    SD_CARD * card = card_get(pdrv);
+    if(card == NULL || count == 0) return RES_PARERR;
+    
+    DRESULT res = RES_OK;
+    for(uint32_t pass = 0; pass < 2 && res == RES_OK; pass++){
+        pf_setBypass(card, pass == 0);
+        
+        uint32_t start = STATS_TIME();
+        for(UINT i = 0; i < count && res == RES_OK; i++) res = disk_read(pdrv, buff, sector + i, 1);
+        uint32_t us = (STATS_TIME() - start) / CT_TICKS_PER_US / count;
+        
+        if(pass == 0){
+            *singleUs = us;
+        }else{
+            *aheadUs = us;
+        }
+    }
+    pf_setBypass(card, 0);
+    
+    return res;
 }
 
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+static DRESULT mmc_read (SD_CARD * card, BYTE* buff, DWORD sector, UINT count)
 {
-	if (pdrv || !count) return RES_PARERR;
-	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (!count) return RES_PARERR;
+	if (card->stat & STA_NOINIT) return RES_NOTRDY;
+    
+    if (pf_read(card, buff, sector, count)) return RES_OK;	/* Served by the read-ahead */
 
-	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+	sector = SD_ADDR(card, sector);	/* Convert to byte address if needed */
 
 	if (count == 1) {		/* Single block read */
-		if ((send_cmd(CMD17, sector) == 0)	/* READ_SINGLE_BLOCK */
-			&& rcvr_datablock(buff, 512))
+		if ((xmit_cmd(card, CMD17, sector) == 0)	/* READ_SINGLE_BLOCK */
+			&& rcvr_datablock(card, buff, 512))
 			count = 0;
 	}
 	else {				/* Multiple block read */
-		if (send_cmd(CMD18, sector) == 0) {	/* READ_MULTIPLE_BLOCK */
+		BYTE preset = set_block_count(card, count);
+		if (xmit_cmd(card, CMD18, sector) == 0) {	/* READ_MULTIPLE_BLOCK */
 			do {
-				if (!rcvr_datablock(buff, 512)) break;
+				if (!rcvr_datablock(card, buff, 512)) break;
 				buff += 512;
 			} while (--count);
-			send_cmd(CMD12, 0);				/* STOP_TRANSMISSION */
+			if (!preset || count) xmit_cmd(card, CMD12, 0);	/* STOP_TRANSMISSION, unless the card stopped on its own */
 		}
 	}
-	deselect();
+	deselect(card);
 
 	return count ? RES_ERROR : RES_OK;
 }
 
-/*-----------------------------------------------------------------------*/
-/* Write Sector(s)                                                       */
-/*-----------------------------------------------------------------------*/
-
-#if _READONLY == 0
-DRESULT w (BYTE drv, const BYTE *buff, DWORD sector, BYTE count){
-	if (drv || !count) return RES_PARERR;
-	if (Stat & STA_NOINIT) return RES_NOTRDY;
-	if (Stat & STA_PROTECT) return RES_WRPRT;
-
-	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
-
-	if (count == 1) {		/* Single block write */
-		if ((send_cmd(CMD24, sector) == 0)	/* WRITE_BLOCK */
-			&& xmit_datablock(buff, 0xFE))
-			count = 0;
-	}
-	else {				/* Multiple block write */
-		if (CardType & CT_SDC) send_cmd(ACMD23, count);
-		if (send_cmd(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
-			do {
-				if (!xmit_datablock(buff, 0xFC)) break;
-				buff += 512;
-			} while (--count);
-			if (!xmit_datablock(0, 0xFD))	/* STOP_TRAN token */
-				count = 1;
-		}
-	}
-	deselect();
-
-	return count ? RES_ERROR : RES_OK;
-}
-#endif /* _READONLY */
 
 
 
@@ -587,27 +1400,36 @@ DRESULT w (BYTE drv, const BYTE *buff, DWORD sector, BYTE count){
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff){
+static DRESULT mmc_ioctl (SD_CARD * card, BYTE ctrl, void *buff){
 	DRESULT res;
 	BYTE n, csd[16], *ptr = buff;
 	DWORD csize;
 
-
-	if (drv) return RES_PARERR;
-	if (Stat & STA_NOINIT) return RES_NOTRDY;
+    //statistics are kept by the driver and available even while the card is powered down. The dma isrs update the 64 bit
+    //counters, so copy them in one go to not get torn values
+    if (ctrl == MMC_GET_STATS){
+        taskENTER_CRITICAL();
+        memcpy(buff, &card->stats, sizeof(MMC_stats_t));
+        taskEXIT_CRITICAL();
+        return RES_OK;
+    }
+    
+	if (card->stat & STA_NOINIT) return RES_NOTRDY;
+    
+    pf_cancel(card);
 
 	res = RES_ERROR;
 	switch (ctrl) {
 		case CTRL_SYNC :	/* Flush dirty buffer if present */
-			if (select()) {
-				deselect();
+			if (select(card)) {
+				deselect(card);
 				res = RES_OK;
 			}
 			break;
 
 		case GET_SECTOR_COUNT :	/* Get number of sectors on the disk (WORD) */
-			if ((send_cmd(CMD9, 0) == 0) && rcvr_datablock(csd, 16)) {
-				if ((csd[0] >> 6) == 1) {	/* SDv2? */
+			if ((send_cmd(card, CMD9, 0) == 0) && rcvr_datablock(card, csd, 16)) {
+				if (SD_HC_ONLY || (csd[0] >> 6) == 1) {	/* SDv2? */
 					csize = csd[9] + ((WORD)csd[8] << 8) + 1;
 					*(DWORD*)buff = (DWORD)csize << 10;
 				} else {					/* SDv1 or MMCv2 */
@@ -625,18 +1447,14 @@ DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff){
 			break;
 
 		case GET_BLOCK_SIZE :	/* Get erase block size in unit of sectors (DWORD) */
-			if (CardType & CT_SD2) {	/* SDv2? */
-				if (send_cmd(ACMD13, 0) == 0) {		/* Read SD status */
-					rcvr_spi();
-					if (rcvr_datablock(csd, 16)) {				/* Read partial block */
-						for (n = 64 - 16; n; n--) rcvr_spi();	/* Purge trailing data */
-						*(DWORD*)buff = 16UL << (csd[10] >> 4);
-						res = RES_OK;
-					}
+			if (SD_HC_ONLY || (card->cardType & CT_SD2)) {	/* SDv2? */
+				if (read_au_size(card, buff)) {
+					if (*(DWORD*)buff == 0) *(DWORD*)buff = 1;	/* AU_SIZE 0 means not defined, 1 is "unknown" to FatFs */
+					res = RES_OK;
 				}
 			} else {					/* SDv1 or MMCv3 */
-				if ((send_cmd(CMD9, 0) == 0) && rcvr_datablock(csd, 16)) {	/* Read CSD */
-					if (CardType & CT_SD1) {	/* SDv1 */
+				if ((send_cmd(card, CMD9, 0) == 0) && rcvr_datablock(card, csd, 16)) {	/* Read CSD */
+					if (card->cardType & CT_SD1) {	/* SDv1 */
 						*(DWORD*)buff = (((csd[10] & 63) << 1) + ((WORD)(csd[11] & 128) >> 7) + 1) << ((csd[13] >> 6) - 1);
 					} else {					/* MMCv3 */
 						*(DWORD*)buff = ((WORD)((csd[10] & 124) >> 2) + 1) * (((csd[11] & 3) << 3) + ((csd[11] & 224) >> 5) + 1);
@@ -646,35 +1464,70 @@ DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff){
 			}
 			break;
 
+		case CTRL_TRIM : {	/* Erase a block of sectors (DWORD[2] with the first and last sector) */
+			DWORD first = ((DWORD*)buff)[0], last = ((DWORD*)buff)[1];
+			uint32_t timeout = ERASE_TIMEOUT_US;
+			DWORD au = get_au_size(card), chunk = 0;
+			if (au) chunk = erase_au_count(card, &timeout) * au;	/* Split at AU boundaries, each command within its timeout */
+			
+			if (!SD_IS_SDC(card) || first > last) break;	/* MMC uses different erase commands */
+			if ((send_cmd(card, CMD9, 0) != 0) || !rcvr_datablock(card, csd, 16)) break;	/* Read CSD */
+			if (!(csd[10] & 0x40)) break;	/* ERASE_BLK_EN, single sectors can be erased */
+			
+			res = RES_OK;
+			while (res == RES_OK) {
+				DWORD end = last;
+				if (chunk && last - first >= chunk - first % chunk) end = first - first % chunk + chunk - 1;
+				
+				res = RES_ERROR;
+				if (send_cmd(card, CMD32, SD_ADDR(card, first)) == 0
+					&& send_cmd(card, CMD33, SD_ADDR(card, end)) == 0
+					&& send_cmd(card, CMD38, 0) == 0) {
+					uint32_t busyStart = STATS_TIME();
+					if (wait_card(card, 1, timeout) == 0xFF) res = RES_OK;
+					card->stats.busyWaitTime += STATS_TIME() - busyStart;
+				}
+				
+				if (end == last) break;
+				first = end + 1;
+			}
+			break;
+		}
+
+		case MMC_GET_ERASED :	/* Get the value erased sectors read as (1 byte) */
+			*ptr = (card->cardCaps & CC_ERASED_FF) ? 0xFF : 0x00;
+			res = RES_OK;
+			break;
+
 		case MMC_GET_TYPE :		/* Get card type flags (1 byte) */
-			*ptr = CardType;
+			*ptr = card->cardType;
 			res = RES_OK;
 			break;
 
 		case MMC_GET_CSD :	/* Receive CSD as a data block (16 bytes) */
-			if ((send_cmd(CMD9, 0) == 0)	/* READ_CSD */
-				&& rcvr_datablock(buff, 16))
+			if ((send_cmd(card, CMD9, 0) == 0)	/* READ_CSD */
+				&& rcvr_datablock(card, buff, 16))
 				res = RES_OK;
 			break;
 
 		case MMC_GET_CID :	/* Receive CID as a data block (16 bytes) */
-			if ((send_cmd(CMD10, 0) == 0)	/* READ_CID */
-				&& rcvr_datablock(buff, 16))
+			if ((send_cmd(card, CMD10, 0) == 0)	/* READ_CID */
+				&& rcvr_datablock(card, buff, 16))
 				res = RES_OK;
 			break;
 
 		case MMC_GET_OCR :	/* Receive OCR as an R3 resp (4 bytes) */
-			if (send_cmd(CMD58, 0) == 0) {	/* READ_OCR */
+			if (send_cmd(card, CMD58, 0) == 0) {	/* READ_OCR */
 				for (n = 0; n < 4; n++)
-					*((BYTE*)buff+n) = rcvr_spi();
+					*((BYTE*)buff+n) = rcvr_spi(card);
 				res = RES_OK;
 			}
 			break;
 
 		case MMC_GET_SDSTAT :	/* Receive SD statsu as a data block (64 bytes) */
-			if (send_cmd(ACMD13, 0) == 0) {	/* SD_STATUS */
-				rcvr_spi();
-				if (rcvr_datablock(buff, 64))
+			if (send_cmd(card, ACMD13, 0) == 0) {	/* SD_STATUS */
+				rcvr_spi(card);
+				if (rcvr_datablock(card, buff, 64))
 					res = RES_OK;
 			}
 			break;
@@ -683,7 +1536,120 @@ DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff){
 			res = RES_PARERR;
 	}
 
-	deselect();
+	deselect(card);
 
 	return res;
-}
\ No newline at end of file
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Public entry points, these own the bus and are traced if enabled      */
+/*-----------------------------------------------------------------------*/
+
+//allows software to tell us that the card was externally shutdown (f.e. powered off) and it needs to be re-initialized
+DSTATUS disk_uninitialize (BYTE drv){
+    SD_CARD * card = card_get(drv);
+    if(card == NULL) return STA_NOINIT;
+    
+    //wait for running transfers, the read-ahead and the isrs must not be touched while someone else uses them. The card
+    //is powered down either way, so it gets marked even if the bus couldn't be taken
+    uint32_t locked = SD_lock(card, uxTaskPriorityGet(NULL));
+    
+    //set STA_NOINIT bit
+	power_off(card);
+    
+    if(locked) SD_unlock(card);
+    return card->stat;
+}
+
+DSTATUS disk_initialize (BYTE drv){
+#if SD_STRIPE_ENABLED
+    if(drv == SD_STRIPE_DRIVE) return STRIPE_initialize();
+#endif
+    SD_CARD * card = card_get(drv);
+    if(card == NULL) return STA_NOINIT;
+    
+    card_wake(card);
+    if(!SD_lock(card, uxTaskPriorityGet(NULL))) return card->stat;
+    DSTATUS stat = mmc_initialize(card);
+    SD_unlock(card);
+    return stat;
+}
+
+DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count){
+#if SD_STRIPE_ENABLED
+    if(pdrv == SD_STRIPE_DRIVE) return STRIPE_read(buff, sector, count);
+#endif
+    SD_CARD * card = card_get(pdrv);
+    if(card == NULL) return RES_PARERR;
+    
+    uint32_t start = STATS_TIME();
+    card_wake(card);
+    if(!SD_take(card, uxTaskPriorityGet(NULL))) return RES_ERROR;
+    pf_cancelBus(card->spiHandle, card);     //the card's own stream is continued or stopped by pf_read
+    DRESULT res = mmc_read(card, buff, sector, count);
+    stats_addLatency(card->stats.readHist, start);
+    SD_unlock(card);
+    DTRACE_END(start, DTRACE_OP_READ, sector, count, 0, res);
+    return res;
+}
+
+#if _READONLY == 0
+DRESULT disk_write (BYTE pdrv, const BYTE *buff, DWORD sector, UINT count){
+#if SD_STRIPE_ENABLED
+    if(pdrv == SD_STRIPE_DRIVE){
+        DRESULT res = STRIPE_write(buff, sector, count);
+        if(res == RES_OK){
+            FSFM_sectorWritten(pdrv, sector, buff, count);
+            PIN_sectorWritten(pdrv, sector, buff, count);
+        }
+        return res;
+    }
+#endif
+    SD_CARD * card = card_get(pdrv);
+    if(card == NULL) return RES_PARERR;
+    
+    uint32_t start = STATS_TIME();
+    card_wake(card);
+    if(!SD_lock(card, uxTaskPriorityGet(NULL))) return RES_ERROR;
+    DRESULT res = mmc_write(card, buff, sector, count);
+    stats_addLatency(card->stats.writeHist, start);
+    SD_unlock(card);
+    
+    //keep the free cluster map up to date if this was a FAT sector, and pinned copies identical to the card
+    if(res == RES_OK){
+        FSFM_sectorWritten(pdrv, sector, buff, count);
+        PIN_sectorWritten(pdrv, sector, buff, count);
+    }
+    DTRACE_END(start, DTRACE_OP_WRITE, sector, count, 0, res);
+    return res;
+}
+#endif /* _READONLY */
+
+DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff){
+#if SD_STRIPE_ENABLED
+    if(drv == SD_STRIPE_DRIVE){
+        DRESULT res = STRIPE_ioctl(ctrl, buff);
+        if(ctrl == CTRL_TRIM) PIN_sectorsErased(drv, ((DWORD *) buff)[0], ((DWORD *) buff)[1]);
+        return res;
+    }
+#endif
+    SD_CARD * card = card_get(drv);
+    if(card == NULL) return RES_PARERR;
+    
+    DTRACE_START(start);
+    
+    //the statistics don't touch the card, so don't make the caller wait for the bus
+    uint32_t needsBus = (ctrl != MMC_GET_STATS);
+    if(needsBus) card_wake(card);
+    if(needsBus && !SD_lock(card, uxTaskPriorityGet(NULL))) return RES_ERROR;
+    DRESULT res = mmc_ioctl(card, ctrl, buff);
+    if(needsBus) SD_unlock(card);
+    
+    //pinned copies of erased sectors don't match the card anymore. A failed trim might have erased some of them as well
+    if(ctrl == CTRL_TRIM) PIN_sectorsErased(drv, ((DWORD *) buff)[0], ((DWORD *) buff)[1]);
+    
+    DTRACE_END(start, DTRACE_OP_IOCTL, 0, ctrl, 0, res);
+    return res;
+}
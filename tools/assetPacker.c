@@ -0,0 +1,222 @@
+/*
+ * Host side packer for the asset archives read by assetPack.c
+ *
+ * Packs every file below a directory into one archive. The name of an asset is its path relative to that directory with
+ * '/' as separator, which is what APK_find expects. Assets of up to one sector are placed so they don't cross a sector
+ * boundary, reading one of them then only costs a single block. The data is stored in directory order, so assets that
+ * sit next to each other in the source tend to be next to each other on the card as well.
+ *
+ * build: cc -O2 -I../include -o assetPacker assetPacker.c
+ *
+ * usage: assetPacker [options] directory archive
+ *      -t          tight packing, don't move small assets to the next sector if they would cross a boundary
+ *      -v          print every asset
+ *
+ * Copy the archive to a card with enough contiguous free space (a freshly formatted one), APK_open refuses fragmented
+ * archives. The index is written as is, so this needs a little endian host like the target.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define APK_HOST_TOOL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "assetPack.h"
+
+#define SECTOR_SIZE 512
+#define PATH_LENGTH 4096
+
+typedef struct{
+    char * name;            //relative to the packed directory
+    char * path;
+    APK_entry_t entry;
+} asset_t;
+
+static asset_t * assets;
+static size_t assetCount;
+static size_t assetCapacity;
+
+//adds every regular file below root/relative to assets
+static int collect(const char * root, const char * relative){
+    char dirPath[PATH_LENGTH];
+    snprintf(dirPath, sizeof(dirPath), "%s%s%s", root, *relative ? "/" : "", relative);
+
+    DIR * dir = opendir(dirPath);
+    if(dir == NULL){
+        perror(dirPath);
+        return -1;
+    }
+
+    struct dirent * de;
+    while((de = readdir(dir)) != NULL){
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+        char name[PATH_LENGTH], path[2 * PATH_LENGTH];
+        snprintf(name, sizeof(name), "%s%s%s", relative, *relative ? "/" : "", de->d_name);
+        snprintf(path, sizeof(path), "%s/%s", root, name);
+
+        struct stat st;
+        if(stat(path, &st)){
+            perror(path);
+            closedir(dir);
+            return -1;
+        }
+
+        if(S_ISDIR(st.st_mode)){
+            if(collect(root, name)){
+                closedir(dir);
+                return -1;
+            }
+            continue;
+        }
+        if(!S_ISREG(st.st_mode)) continue;
+
+        if((uint64_t) st.st_size > UINT32_MAX){
+            fprintf(stderr, "%s is too large\n", path);
+            closedir(dir);
+            return -1;
+        }
+
+        if(assetCount == assetCapacity){
+            assetCapacity = assetCapacity ? assetCapacity * 2 : 256;
+            assets = realloc(assets, assetCapacity * sizeof(asset_t));
+            if(assets == NULL){
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        asset_t * asset = &assets[assetCount++];
+        asset->name = strdup(name);
+        asset->path = strdup(path);
+        asset->entry.hash = APK_hash(name);
+        asset->entry.check = APK_check(name);
+        asset->entry.length = st.st_size;
+        asset->entry.offset = 0;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static int compareHash(const void * a, const void * b){
+    const asset_t * assetA = *(const asset_t * const *) a;
+    const asset_t * assetB = *(const asset_t * const *) b;
+    if(assetA->entry.hash < assetB->entry.hash) return -1;
+    return assetA->entry.hash > assetB->entry.hash;
+}
+
+static int copyData(FILE * out, const asset_t * asset){
+    FILE * in = fopen(asset->path, "rb");
+    if(in == NULL){
+        perror(asset->path);
+        return -1;
+    }
+
+    char buff[65536];
+    uint64_t copied = 0;
+    size_t length;
+    while((length = fread(buff, 1, sizeof(buff), in)) > 0){
+        if(fwrite(buff, 1, length, out) != length){
+            perror("write");
+            fclose(in);
+            return -1;
+        }
+        copied += length;
+    }
+    fclose(in);
+
+    if(copied != asset->entry.length){
+        fprintf(stderr, "%s changed while packing it\n", asset->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char * name){
+    fprintf(stderr, "usage: %s [-t] [-v] directory archive\n", name);
+    exit(1);
+}
+
+int main(int argc, char ** argv){
+    int tight = 0, verbose = 0;
+    int arg = 1;
+
+    for(; arg < argc && argv[arg][0] == '-'; arg++){
+        if(!strcmp(argv[arg], "-t")){
+            tight = 1;
+        }else if(!strcmp(argv[arg], "-v")){
+            verbose = 1;
+        }else{
+            usage(argv[0]);
+        }
+    }
+    if(argc - arg != 2) usage(argv[0]);
+    const char * root = argv[arg];
+    const char * archivePath = argv[arg + 1];
+
+    if(collect(root, "")) return 1;
+
+    //place the data behind the index in directory order
+    uint64_t offset = sizeof(APK_header_t) + (uint64_t) assetCount * sizeof(APK_entry_t);
+    uint64_t padding = 0;
+    for(size_t i = 0; i < assetCount; i++){
+        uint32_t length = assets[i].entry.length;
+        if(!tight && length > 0 && length <= SECTOR_SIZE && offset / SECTOR_SIZE != (offset + length - 1) / SECTOR_SIZE){
+            uint64_t aligned = (offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+            padding += aligned - offset;
+            offset = aligned;
+        }
+        if(offset + length > UINT32_MAX){
+            fprintf(stderr, "archive would be larger than 4GB\n");
+            return 1;
+        }
+        assets[i].entry.offset = offset;
+        offset += length;
+    }
+
+    //the index is sorted by hash, which has to be unique
+    asset_t ** sorted = malloc((assetCount ? assetCount : 1) * sizeof(asset_t *));
+    for(size_t i = 0; i < assetCount; i++) sorted[i] = &assets[i];
+    qsort(sorted, assetCount, sizeof(asset_t *), compareHash);
+
+    for(size_t i = 1; i < assetCount; i++){
+        if(sorted[i]->entry.hash == sorted[i - 1]->entry.hash){
+            fprintf(stderr, "\"%s\" and \"%s\" have the same hash, rename one of them\n", sorted[i - 1]->name, sorted[i]->name);
+            return 1;
+        }
+    }
+
+    FILE * out = fopen(archivePath, "wb");
+    if(out == NULL){
+        perror(archivePath);
+        return 1;
+    }
+
+    APK_header_t header = {.magic = APK_MAGIC, .version = APK_VERSION, .entrySize = sizeof(APK_entry_t), .entryCount = assetCount};
+    fwrite(&header, sizeof(header), 1, out);
+    for(size_t i = 0; i < assetCount; i++) fwrite(&sorted[i]->entry, sizeof(APK_entry_t), 1, out);
+
+    for(size_t i = 0; i < assetCount; i++){
+        //padding in front of assets that were moved to the next sector
+        while((uint64_t) ftell(out) < assets[i].entry.offset) fputc(0, out);
+
+        if(copyData(out, &assets[i])){
+            fclose(out);
+            return 1;
+        }
+        if(verbose) printf("%08x %10u %8u %s\n", assets[i].entry.hash, assets[i].entry.offset, assets[i].entry.length, assets[i].name);
+    }
+
+    if(fclose(out)){
+        perror(archivePath);
+        return 1;
+    }
+
+    printf("%zu assets, %llu bytes (%llu of them padding)\n", assetCount, (unsigned long long) offset, (unsigned long long) padding);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * Host side replay of traces captured with the DTRACE layer of the sd driver
+ *
+ * Re-issues every traced read/write against either a disk image (or a real card reader device) or a simple timing model of a
+ * spi sd card, optionally with the original timing between operations, and prints the latency of the replay next to the
+ * latency that was recorded on the target.
+ *
+ * build: cc -O2 -I../include -o diskTraceReplay diskTraceReplay.c
+ *
+ * usage: diskTraceReplay [options] trace
+ *      -x          trace is a hex dump from DTRACE_dumpToTerminal instead of a binary file from DTRACE_dumpToFile
+ *      -i image    replay against this image file or block device
+ *      -w          also replay writes to the image (filled with 0xa5, so use a copy!). Writes are skipped otherwise
+ *      -s us,MBps  replay against the card model with the given per command overhead and bus throughput (default 100,6)
+ *      -t          keep the original spacing between operations instead of replaying as fast as possible
+ *      -v          print every operation
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#define DTRACE_HOST_TOOL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "diskTrace.h"
+
+#define SECTOR_SIZE 512
+
+static const char * opNames[] = {"read", "write", "readList", "ioctl"};
+
+typedef struct{
+    uint64_t count;
+    uint64_t bytes;
+    double recordedTime;
+    double replayTime;
+    double recordedMax;
+    double replayMax;
+} opStats_t;
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleepUntil(double t){
+    double delta = t - now();
+    if(delta <= 0) return;
+
+    struct timespec ts;
+    ts.tv_sec = (time_t) delta;
+    ts.tv_nsec = (long) ((delta - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+static int parseHexLine(const char * line, uint8_t * dst, size_t length){
+    for(size_t i = 0; i < length; i++){
+        unsigned int byte;
+        if(sscanf(line + i * 2, "%2x", &byte) != 1) return 0;
+        dst[i] = byte;
+    }
+    return 1;
+}
+
+//loads the whole trace into memory. Returns the record array and fills in the header
+static DTRACE_record_t * loadTrace(const char * path, int hex, DTRACE_fileHeader_t * header, size_t * count){
+    FILE * f = fopen(path, hex ? "r" : "rb");
+    if(!f){
+        perror(path);
+        return NULL;
+    }
+
+    size_t capacity = 1024;
+    DTRACE_record_t * records = malloc(capacity * sizeof(DTRACE_record_t));
+    int haveHeader = 0;
+    *count = 0;
+
+    if(hex){
+        char line[256];
+        while(fgets(line, sizeof(line), f)){
+            //the terminal might prefix the lines with anything, look for the tag
+            char * tag = strstr(line, "H:");
+            if(tag && parseHexLine(tag + 2, (uint8_t *) header, sizeof(*header))){
+                haveHeader = 1;
+                continue;
+            }
+
+            tag = strstr(line, "R:");
+            if(!tag) continue;
+            if(*count == capacity){
+                capacity *= 2;
+                records = realloc(records, capacity * sizeof(DTRACE_record_t));
+            }
+            if(parseHexLine(tag + 2, (uint8_t *) &records[*count], sizeof(DTRACE_record_t))) (*count)++;
+        }
+    }else{
+        haveHeader = fread(header, sizeof(*header), 1, f) == 1;
+        while(haveHeader){
+            if(*count == capacity){
+                capacity *= 2;
+                records = realloc(records, capacity * sizeof(DTRACE_record_t));
+            }
+            if(fread(&records[*count], sizeof(DTRACE_record_t), 1, f) != 1) break;
+            (*count)++;
+        }
+    }
+    fclose(f);
+
+    if(!haveHeader || header->magic != DTRACE_MAGIC || header->recordSize != sizeof(DTRACE_record_t)){
+        fprintf(stderr, "%s: not a trace of version %d\n", path, DTRACE_VERSION);
+        free(records);
+        return NULL;
+    }
+
+    if(header->dropped) fprintf(stderr, "warning: %u records were dropped on the target, the trace has gaps\n", header->dropped);
+
+    return records;
+}
+
+//bytes moved on the bus by a record
+static uint64_t recordBytes(const DTRACE_record_t * rec){
+    if(rec->op == DTRACE_OP_READLIST) return rec->length;
+    if(rec->op == DTRACE_OP_IOCTL) return 0;
+    return (uint64_t) rec->length * SECTOR_SIZE;
+}
+
+int main(int argc, char ** argv){
+    int hex = 0, writes = 0, timed = 0, verbose = 0, opt;
+    const char * imagePath = NULL;
+    double cmdOverhead = 100e-6, busSpeed = 6e6;
+
+    while((opt = getopt(argc, argv, "xi:ws:tv")) != -1){
+        switch(opt){
+            case 'x': hex = 1; break;
+            case 'i': imagePath = optarg; break;
+            case 'w': writes = 1; break;
+            case 's':
+                if(sscanf(optarg, "%lf,%lf", &cmdOverhead, &busSpeed) != 2){
+                    fprintf(stderr, "-s needs <us>,<MBps>\n");
+                    return 1;
+                }
+                cmdOverhead *= 1e-6;
+                busSpeed *= 1e6;
+                break;
+            case 't': timed = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-x] [-i image [-w]] [-s us,MBps] [-t] [-v] trace\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind >= argc){
+        fprintf(stderr, "no trace given\n");
+        return 1;
+    }
+
+    DTRACE_fileHeader_t header;
+    size_t count;
+    DTRACE_record_t * records = loadTrace(argv[optind], hex, &header, &count);
+    if(!records) return 1;
+    if(count == 0){
+        printf("trace is empty\n");
+        return 0;
+    }
+
+    int fd = -1;
+    if(imagePath){
+        fd = open(imagePath, writes ? O_RDWR : O_RDONLY);
+        if(fd < 0){
+            perror(imagePath);
+            return 1;
+        }
+    }
+
+    uint8_t * buffer = NULL;
+    size_t bufferSize = 0;
+    opStats_t stats[4];
+    memset(stats, 0, sizeof(stats));
+
+    double tickLength = 1.0 / header.timerFreq;
+    double replayStart = now();
+    double modelTime = 0;
+    uint32_t firstTimestamp = records[0].timestamp;
+
+    for(size_t i = 0; i < count; i++){
+        DTRACE_record_t * rec = &records[i];
+        if(rec->op > DTRACE_OP_IOCTL) continue;
+
+        //timestamps are a free running 32bit counter, so only the difference to the first record means anything
+        double offset = (uint32_t) (rec->timestamp - firstTimestamp) * tickLength;
+        if(timed) sleepUntil(replayStart + offset);
+
+        uint64_t bytes = recordBytes(rec);
+        double latency;
+
+        if(fd >= 0){
+            off_t position = (off_t) rec->sector * SECTOR_SIZE + (rec->op == DTRACE_OP_READLIST ? rec->offset : 0);
+            if(bytes > bufferSize){
+                bufferSize = bytes;
+                buffer = realloc(buffer, bufferSize);
+            }
+
+            double start = now();
+            if(rec->op == DTRACE_OP_WRITE){
+                if(writes){
+                    memset(buffer, 0xa5, bytes);
+                    if(pwrite(fd, buffer, bytes, position) != (ssize_t) bytes) fprintf(stderr, "write of sector %u failed\n", rec->sector);
+                }
+            }else if(bytes){
+                if(pread(fd, buffer, bytes, position) != (ssize_t) bytes) fprintf(stderr, "read of sector %u failed\n", rec->sector);
+            }
+            latency = now() - start;
+        }else{
+            //card model: fixed command overhead plus the time the bytes spend on the bus, sequential to the previous op
+            latency = cmdOverhead + bytes / busSpeed;
+            if(timed && modelTime < offset) modelTime = offset;
+            modelTime += latency;
+        }
+
+        opStats_t * s = &stats[rec->op];
+        double recorded = rec->latency * tickLength;
+        s->count++;
+        s->bytes += bytes;
+        s->recordedTime += recorded;
+        s->replayTime += latency;
+        if(recorded > s->recordedMax) s->recordedMax = recorded;
+        if(latency > s->replayMax) s->replayMax = latency;
+
+        if(verbose) printf("%10.6f %-8s sector=%-10u len=%-8u off=%-3u res=%u recorded=%9.1fus replay=%9.1fus\n", offset, opNames[rec->op], rec->sector, rec->length, rec->offset, rec->result, recorded * 1e6, latency * 1e6);
+    }
+
+    double traceLength = (uint32_t) (records[count - 1].timestamp - firstTimestamp) * tickLength + records[count - 1].latency * tickLength;
+    double replayLength = fd >= 0 ? now() - replayStart : modelTime;
+
+    printf("%zu records, %.3fs on the target, %.3fs replayed against %s\n", count, traceLength, replayLength, fd >= 0 ? imagePath : "the card model");
+    printf("%-8s %8s %12s %12s %12s %12s %12s\n", "op", "count", "bytes", "rec avg us", "rec max us", "rep avg us", "rep max us");
+    for(int op = 0; op < 4; op++){
+        opStats_t * s = &stats[op];
+        if(!s->count) continue;
+        printf("%-8s %8llu %12llu %12.1f %12.1f %12.1f %12.1f\n", opNames[op], (unsigned long long) s->count, (unsigned long long) s->bytes,
+                s->recordedTime / s->count * 1e6, s->recordedMax * 1e6, s->replayTime / s->count * 1e6, s->replayMax * 1e6);
+    }
+
+    if(fd >= 0) close(fd);
+    free(buffer);
+    free(records);
+    return 0;
+}